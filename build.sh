@@ -8,6 +8,11 @@ mkdir -p .modules-07136E57-$MACHINE-tools_bench_threads
 mkdir -p .modules-0F2EC1CC-$MACHINE-tools_bench_threads_libc
 mkdir -p .modules-CC779790-$MACHINE-tools_bench_std_list
 mkdir -p .modules-C8A5C153-$MACHINE-tools_bench_std_list_libc
+mkdir -p .modules-5E0B7A39-$MACHINE-tools_bench_mixed
+mkdir -p .modules-9D43F2C6-$MACHINE-tools_bench_mixed_classes
+mkdir -p .modules-3A6F1D24-$MACHINE-tools_bench_bulk
+mkdir -p .modules-8E52C0B7-$MACHINE-tools_bench_churn
+mkdir -p .modules-4B7D09E3-$MACHINE-tools_test_reuse_aligned
 gcc -c -o .modules-B4E4FE1B-$MACHINE-kissmalloc_src/kissmalloc.o -DNDEBUG -O2 -fPIC -Wall -pthread -pipe -D_FILE_OFFSET_BITS=64 -DCCBUILD_BUNDLE_VERSION=0.1.0 -DKISSMALLOC_OVERLOAD_LIBC $SOURCE/src/kissmalloc.c &
 g++ -c -o .modules-B4E4FE1B-$MACHINE-kissmalloc_src/kissmalloc_new.o -DNDEBUG -O2 -fPIC -Wall -pthread -pipe -std=c++11 -D_FILE_OFFSET_BITS=64 -DCCBUILD_BUNDLE_VERSION=0.1.0 -DKISSMALLOC_OVERLOAD_LIBC $SOURCE/src/kissmalloc_new.cc &
 wait
@@ -36,3 +41,18 @@ g++ -o kissbench_std_list -pthread .modules-CC779790-$MACHINE-tools_bench_std_li
 g++ -c -o .modules-C8A5C153-$MACHINE-tools_bench_std_list_libc/main.o -DNDEBUG -O2 -fPIC -Wall -pthread -pipe -std=c++11 -D_FILE_OFFSET_BITS=64 -DCCBUILD_BUNDLE_VERSION=0.1.0 $SOURCE/tools/bench_std_list_libc/main.cc &
 wait
 g++ -o kissbench_std_list_libc -pthread .modules-C8A5C153-$MACHINE-tools_bench_std_list_libc/main.o -L. -Wl,--enable-new-dtags,-rpath='$ORIGIN',-rpath='$ORIGIN'/../lib,-rpath-link=$PWD
+gcc -c -o .modules-5E0B7A39-$MACHINE-tools_bench_mixed/main.o -DNDEBUG -O2 -fPIC -Wall -pthread -pipe -D_FILE_OFFSET_BITS=64 -DCCBUILD_BUNDLE_VERSION=0.1.0 -DKISSMALLOC_OVERLOAD_LIBC -I$SOURCE/src $SOURCE/tools/bench_mixed/main.c &
+wait
+gcc -o kissbench_mixed -pthread .modules-5E0B7A39-$MACHINE-tools_bench_mixed/main.o -L. -lkissmalloc -Wl,--enable-new-dtags,-rpath='$ORIGIN',-rpath='$ORIGIN'/../lib,-rpath-link=$PWD
+gcc -c -o .modules-9D43F2C6-$MACHINE-tools_bench_mixed_classes/main.o -DNDEBUG -O2 -fPIC -Wall -pthread -pipe -D_FILE_OFFSET_BITS=64 -DCCBUILD_BUNDLE_VERSION=0.1.0 -DKISSMALLOC_OVERLOAD_LIBC $SOURCE/tools/bench_mixed_classes/main.c &
+wait
+gcc -o kissbench_mixed_classes -pthread .modules-9D43F2C6-$MACHINE-tools_bench_mixed_classes/main.o -L. -Wl,--enable-new-dtags,-rpath='$ORIGIN',-rpath='$ORIGIN'/../lib,-rpath-link=$PWD
+gcc -c -o .modules-3A6F1D24-$MACHINE-tools_bench_bulk/main.o -DNDEBUG -O2 -fPIC -Wall -pthread -pipe -D_FILE_OFFSET_BITS=64 -DCCBUILD_BUNDLE_VERSION=0.1.0 -DKISSMALLOC_OVERLOAD_LIBC -I$SOURCE/src $SOURCE/tools/bench_bulk/main.c &
+wait
+gcc -o kissbench_bulk -pthread .modules-3A6F1D24-$MACHINE-tools_bench_bulk/main.o -L. -lkissmalloc -Wl,--enable-new-dtags,-rpath='$ORIGIN',-rpath='$ORIGIN'/../lib,-rpath-link=$PWD
+gcc -c -o .modules-8E52C0B7-$MACHINE-tools_bench_churn/main.o -DNDEBUG -O2 -fPIC -Wall -pthread -pipe -D_FILE_OFFSET_BITS=64 -DCCBUILD_BUNDLE_VERSION=0.1.0 -DKISSMALLOC_OVERLOAD_LIBC $SOURCE/tools/bench_churn/main.c &
+wait
+gcc -o kissbench_churn -pthread .modules-8E52C0B7-$MACHINE-tools_bench_churn/main.o -L. -Wl,--enable-new-dtags,-rpath='$ORIGIN',-rpath='$ORIGIN'/../lib,-rpath-link=$PWD
+gcc -c -o .modules-4B7D09E3-$MACHINE-tools_test_reuse_aligned/main.o -DNDEBUG -O2 -fPIC -Wall -pthread -pipe -D_FILE_OFFSET_BITS=64 -DCCBUILD_BUNDLE_VERSION=0.1.0 -DKISSMALLOC_OVERLOAD_LIBC $SOURCE/tools/test_reuse_aligned/main.c &
+wait
+gcc -o kisstest_reuse_aligned -pthread .modules-4B7D09E3-$MACHINE-tools_test_reuse_aligned/main.o -L. -Wl,--enable-new-dtags,-rpath='$ORIGIN',-rpath='$ORIGIN'/../lib,-rpath-link=$PWD
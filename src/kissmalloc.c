@@ -6,6 +6,10 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // mremap
+#endif
+
 #include "kissmalloc.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -32,6 +36,132 @@
 #define KISSMALLOC_PAGE_SIZE 0
 #endif
 
+/// How freed pages are returned to the system: 0 = munmap(2), 1 = madvise(MADV_DONTNEED), 2 = madvise(MADV_FREE)
+/// (the madvise policies keep each preallocated run mapped until all of its pages have been released, which is also
+/// what allows memmaps() to count the mappings held, with munmap(2) memmaps() reports 0)
+#ifndef KISSMALLOC_PAGE_RELEASE
+#define KISSMALLOC_PAGE_RELEASE 0
+#endif
+
+/// Hand out cached pages as new buckets before taking fresh pages from the preallocated run
+#if 0
+#define KISSMALLOC_PAGE_RECYCLE
+#endif
+
+/// How recycled pages are cleared: 0 = memset(3), 1 = madvise(MADV_DONTNEED), 2 = not at all (calloc() clears instead)
+#ifndef KISSMALLOC_RECYCLE_ZERO
+#define KISSMALLOC_RECYCLE_ZERO 0
+#endif
+
+/// Number of bytes of freed large allocations each thread keeps mapped for reuse (0 to disable)
+#ifndef KISSMALLOC_LARGE_CACHE
+#define KISSMALLOC_LARGE_CACHE 0
+#endif
+
+/// Number of large allocation cache operations after which an unused entry gets unmapped
+#ifndef KISSMALLOC_LARGE_CACHE_DECAY
+#define KISSMALLOC_LARGE_CACHE_DECAY 1024
+#endif
+
+/// Grow and shrink large allocations in realloc() by mremap(2) where available (0 to always copy)
+#ifndef KISSMALLOC_MREMAP
+#define KISSMALLOC_MREMAP 1
+#endif
+
+/// Back preallocated runs and large allocations by transparent huge pages (see madvise(2), MADV_HUGEPAGE)
+#if 0
+#define KISSMALLOC_HUGEPAGE
+#endif
+
+/// Huge page size, preallocated runs are extended and aligned to this size in huge page mode
+#ifndef KISSMALLOC_HUGEPAGE_SIZE
+#define KISSMALLOC_HUGEPAGE_SIZE (2 << 20)
+#endif
+
+/// Return pages emptied by other threads to the zone of the thread which allocated them
+/// (best combined with KISSMALLOC_PAGE_RECYCLE; zones of exited threads are kept for reuse by new threads instead of being unmapped)
+#if 0
+#define KISSMALLOC_REMOTE_FREE
+#endif
+
+/// Give the free balance of each small object page a cache line of its own, so that free() in other threads does not
+/// disturb the owning thread allocating from the same page (grows the page header from 64 to 128 bytes with 4 KiB pages)
+#if 0
+#define KISSMALLOC_BALANCE_LINE
+#endif
+
+/// Keep the zones of exited threads with their preallocated pages and page cache in a process-wide depot,
+/// from which new threads adopt a zone before mapping fresh memory (memory held then never exceeds the peak of all threads)
+#if 0
+#define KISSMALLOC_ZONE_DEPOT
+#endif
+
+/// Share one zone among all threads running on the same CPU instead of giving each thread a zone of its own
+/// (the CPU is looked up through rseq(2) where available, but operations are not restartable sequences: each operation
+/// holds a spin lock on the zone, so a thread preempted while holding it makes the other threads of that CPU yield)
+#if 0
+#define KISSMALLOC_PER_CPU
+#endif
+
+/// Bind the preallocated runs and large allocations of each zone to the NUMA node the zone was created on
+/// (implies KISSMALLOC_REMOTE_FREE, so that freed pages return to the zone of their node)
+#if 0
+#define KISSMALLOC_NUMA
+#endif
+
+/// Keep the current bucket and the usage counter of each thread in initial-exec TLS variables instead of pthread keys
+/// (saves the pthread_getspecific(3) calls on the fast path, but the library can no longer be loaded reliably by dlopen(3))
+#if 0
+#define KISSMALLOC_TLS
+#endif
+
+/// Number of counters the process-wide memory usage is spread over (needs to be a power of two, 1 for a single counter)
+#ifndef KISSMALLOC_USAGE_SHARDS
+#define KISSMALLOC_USAGE_SHARDS 64
+#endif
+
+/// Number of bytes each thread accumulates locally before updating its usage counter
+/// (0 for exact accounting, otherwise memusage() may be off by this amount per thread)
+#ifndef KISSMALLOC_USAGE_BATCH
+#define KISSMALLOC_USAGE_BATCH 0
+#endif
+
+/// Serve small objects from segregated size-class pages instead of a single mixed bump page per thread
+#if 0
+#define KISSMALLOC_SIZE_CLASSES
+#endif
+
+/// Largest object size served from size-class pages (needs to be a power of two, with 4 KiB pages anything above 1024
+/// leaves the top classes with a single object per page, wasting up to half of each such page)
+#ifndef KISSMALLOC_SIZE_CLASS_MAX
+#define KISSMALLOC_SIZE_CLASS_MAX 1024
+#endif
+
+/// Reuse objects of size-class pages, which have been freed by the owning thread, for allocations of the same size class
+/// before mapping fresh pages (keeps long-running single-threaded programs at the size of their peak live data, implies KISSMALLOC_SIZE_CLASSES)
+#if 0
+#define KISSMALLOC_REUSE
+#endif
+
+/// Time in milliseconds after which a background thread hands back the cached pages, the unused preallocated pages and
+/// the cached large mappings of zones, which have not taken or returned any pages for that long (0 for no background thread,
+/// which is otherwise started along with the first zone)
+#ifndef KISSMALLOC_DECAY_TIME
+#define KISSMALLOC_DECAY_TIME 0
+#endif
+
+/// Let free() on the owning thread take back the most recent allocation of the current mixed page, so that stack-like
+/// malloc()/free() sequences keep reusing the same cache lines (checked against the object-start bitmap, needs no size field)
+#if 0
+#define KISSMALLOC_REWIND
+#endif
+
+/// Let kiss_scope_begin() redirect the small malloc() requests of the calling thread into a region of its own, which
+/// kiss_scope_end() releases in one step (freeing objects of a scope is a no-op, using them after the scope has ended is undefined)
+#if 0
+#define KISSMALLOC_SCOPES
+#endif
+
 /// Output size distribution histograms at exit (debug option)
 #if 0
 #define KISSMALLOC_HISTOGRAM
@@ -44,6 +174,10 @@
 
 #define KISSMALLOC_GRANULARITY_SHIFT (__builtin_ctz(KISSMALLOC_GRANULARITY))
 
+#define KISSMALLOC_CACHE_LINE_SIZE 64
+
+#define KISSMALLOC_RUN_MIN (KISSMALLOC_PAGE_PREALLOC < 16 ? KISSMALLOC_PAGE_PREALLOC : 16) // smallest preallocated run in pages
+
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <stdlib.h> // abort, getenv
@@ -53,6 +187,13 @@
 #include <errno.h>
 #include <stdint.h>
 #include <assert.h>
+#include <fcntl.h> // open
+#include <sys/syscall.h> // SYS_mbind, SYS_getcpu
+#include <time.h> // nanosleep
+#include <stdio.h> // FILE, fprintf
+#ifdef KISSMALLOC_OVERLOAD_LIBC
+#include <malloc.h> // struct mallinfo2
+#endif
 
 #ifndef MAP_ANONYMOUS
 #define MAP_ANONYMOUS MAP_ANON
@@ -62,32 +203,134 @@
 #define MAP_POPULATE 0
 #endif
 
+#ifndef MADV_FREE
+#define MADV_FREE MADV_DONTNEED
+#endif
+
+#ifdef M_TRIM_THRESHOLD
+static_assert(
+    KISS_M_TRIM_THRESHOLD == M_TRIM_THRESHOLD && KISS_M_TOP_PAD == M_TOP_PAD &&
+    KISS_M_MMAP_THRESHOLD == M_MMAP_THRESHOLD && KISS_M_ARENA_MAX == M_ARENA_MAX,
+    "The mallopt() parameters need to match the ones of <malloc.h>"
+);
+#endif
+
 #define KISSMALLOC_IS_POW2(x) (x > 0 && (x & (x - 1)) == 0)
 
 static_assert(KISSMALLOC_IS_POW2(KISSMALLOC_GRANULARITY), "KISSMALLOC_GRANULARITY needs to be a power of two");
+static_assert(KISSMALLOC_IS_POW2(KISSMALLOC_USAGE_SHARDS), "KISSMALLOC_USAGE_SHARDS needs to be a power of two");
+
+#if defined(KISSMALLOC_PAGE_RECYCLE) && KISSMALLOC_RECYCLE_ZERO == 2
+#define KISSMALLOC_DIRTY_PAGES
+#endif
+
+#if defined(KISSMALLOC_REUSE) && !defined(KISSMALLOC_SIZE_CLASSES)
+#define KISSMALLOC_SIZE_CLASSES
+#endif
+
+#if defined(KISSMALLOC_NUMA) && !defined(KISSMALLOC_REMOTE_FREE)
+#define KISSMALLOC_REMOTE_FREE
+#endif
+
+#if KISSMALLOC_DECAY_TIME > 0
+#define KISSMALLOC_DECAY // zones are registered, so that the background thread can find them
+#endif
+
+#if defined(KISSMALLOC_ZONE_DEPOT) || defined(KISSMALLOC_REMOTE_FREE)
+#define KISSMALLOC_DEPOT // zones are put into the depot at thread exit instead of being unmapped
+#endif
 
 #define KISSMALLOC_LIKELY(x) __builtin_expect((x),1)
 #define KISSMALLOC_UNLIKELY(x) __builtin_expect((x),0)
 
+#ifdef KISSMALLOC_SIZE_CLASSES
+
+/// Eight linear classes up to 8 * KISSMALLOC_GRANULARITY, followed by four classes per doubling
+#define KISSMALLOC_SIZE_CLASS_COUNT (8 + 4 * (__builtin_ctz(KISSMALLOC_SIZE_CLASS_MAX) - KISSMALLOC_GRANULARITY_SHIFT - 3))
+
+static_assert(KISSMALLOC_IS_POW2(KISSMALLOC_SIZE_CLASS_MAX), "KISSMALLOC_SIZE_CLASS_MAX needs to be a power of two");
+static_assert(KISSMALLOC_SIZE_CLASS_MAX >= 8 * KISSMALLOC_GRANULARITY, "KISSMALLOC_SIZE_CLASS_MAX needs to be at least 8 * KISSMALLOC_GRANULARITY");
+
+#endif
+
+#if KISSMALLOC_LARGE_CACHE > 0
+
+/// Large allocations are binned by the binary logarithm of their mapping size
+#define KISSMALLOC_LARGE_CACHE_BINS (8 * sizeof(long) - __builtin_clzl(KISSMALLOC_LARGE_CACHE))
+#define KISSMALLOC_LARGE_CACHE_BIN_SIZE 8
+
+struct large_entry_t {
+    uint8_t *head;
+    size_t size;
+    uint32_t tick;
+};
+
+struct large_cache_t {
+    size_t size_total;
+    uint32_t tick;
+    uint8_t fill[KISSMALLOC_LARGE_CACHE_BINS];
+    struct large_entry_t entry[KISSMALLOC_LARGE_CACHE_BINS][KISSMALLOC_LARGE_CACHE_BIN_SIZE];
+};
+
+#endif
+
 #pragma pack(push,1)
 
 struct cache_t;
+struct cpu_zone_t;
 
 struct bucket_t {
-    uint32_t object_count; // please keep at the beginning of the structure for alignment/atomicity reason
+    uint32_t object_count; // number of objects allocated from the page so far (only touched by the owning thread)
     uint32_t bytes_free;
     struct cache_t *cache;
+    #ifdef KISSMALLOC_SIZE_CLASSES
+    uint32_t object_size; // size of all objects on a size-class page, zero for a mixed page
+    #endif
+    uint32_t object_map[]; // one bit per KISSMALLOC_GRANULARITY bytes, set where an object of a mixed page starts
 };
 
 struct cache_t {
     uint32_t prealloc_count;
     uint32_t fill;
+    uint8_t *prealloc_next;
+    #ifdef KISSMALLOC_REMOTE_FREE
+    struct bucket_t *remote; // pages emptied by other threads (lock-free stack, linked through the first object slot)
+    #endif
+    #ifdef KISSMALLOC_DEPOT
+    struct cache_t *depot_next; // link in the depot of zones of exited threads
+    #endif
+    #ifdef KISSMALLOC_SIZE_CLASSES
+    struct bucket_t *class_bucket[KISSMALLOC_SIZE_CLASS_COUNT];
+    #endif
+    #ifdef KISSMALLOC_REUSE
+    struct bucket_t *class_partial[KISSMALLOC_SIZE_CLASS_COUNT]; // retired pages with freed objects to reuse
+    #endif
+    #ifdef KISSMALLOC_DECAY
+    char lock; // protects the page cache, the preallocated run and the large cache against the background thread
+    uint32_t tick; // number of page operations of the zone so far
+    uint32_t decay_tick; // tick seen by the last pass of the background thread
+    struct cache_t *registry_next; // links in the registry of all zones
+    struct cache_t *registry_prev;
+    #endif
+    #if KISSMALLOC_LARGE_CACHE > 0
+    struct large_cache_t large;
+    #endif
     struct bucket_t *buffer[KISSMALLOC_PAGE_CACHE];
+    #ifdef KISSMALLOC_NUMA
+    int32_t node; // NUMA node the memory of the zone is bound to
+    #endif
+    #ifdef KISSMALLOC_PER_CPU
+    struct cpu_zone_t *cpu_zone; // per-CPU zone the cache belongs to
+    #endif
 };
 
 #pragma pack(pop)
 
-static_assert(sizeof(struct bucket_t) <= KISSMALLOC_GRANULARITY, "The bucket_t header must not exceed KISSMALLOC_GRANULARITY bytes");
+#ifdef KISSMALLOC_SIZE_CLASSES
+static_assert(sizeof(struct bucket_t) <= 2 * KISSMALLOC_GRANULARITY, "The fixed part of the bucket_t header must not exceed 2 * KISSMALLOC_GRANULARITY bytes");
+#else
+static_assert(sizeof(struct bucket_t) <= KISSMALLOC_GRANULARITY, "The fixed part of the bucket_t header must not exceed KISSMALLOC_GRANULARITY bytes");
+#endif
 
 inline static size_t round_up_pow2(const size_t x, const size_t g)
 {
@@ -106,555 +349,3002 @@ inline static size_t page_size_get()
     #endif
 }
 
-inline static void cache_xchg(struct bucket_t **buffer, int i, int j)
+inline static size_t bucket_object_map_size_get()
 {
-    struct bucket_t *h = buffer[i];
-    buffer[i] = buffer[j];
-    buffer[j] = h;
+    return (((page_size_get() >> KISSMALLOC_GRANULARITY_SHIFT) + 31) >> 5) * sizeof(uint32_t);
 }
 
-inline static int cache_parent(int i)
+#ifdef KISSMALLOC_REUSE
+
+/** Objects of a size-class page freed by the owning thread, which are kept for reuse instead of counting against the balance
+  * (kept next to the balance counter, which the owner only touches when freeing, too)
+  */
+struct bucket_reuse_t {
+    void *free_list; // linked through the first word of each object
+    struct bucket_t *partial_next; // links in the list of retired pages with freed objects of the zone
+    struct bucket_t *partial_prev;
+    uint32_t free_count;
+};
+
+#ifdef KISSMALLOC_BALANCE_LINE
+static_assert(sizeof(int64_t) + sizeof(struct bucket_reuse_t) <= KISSMALLOC_CACHE_LINE_SIZE, "struct bucket_reuse_t needs to fit next to the balance counter");
+#endif
+
+#define KISSMALLOC_BALANCE_SIZE (sizeof(int64_t) + sizeof(struct bucket_reuse_t))
+#else
+#define KISSMALLOC_BALANCE_SIZE sizeof(int64_t)
+#endif // KISSMALLOC_REUSE
+
+inline static size_t bucket_balance_offset_get()
 {
-    return (i - 1) >> 1;
+    #ifdef KISSMALLOC_BALANCE_LINE
+    return round_up_pow2(sizeof(struct bucket_t) + bucket_object_map_size_get(), KISSMALLOC_CACHE_LINE_SIZE);
+    #else
+    return round_up_pow2(sizeof(struct bucket_t) + bucket_object_map_size_get(), sizeof(int64_t));
+    #endif
 }
 
-inline static int cache_child_left(int i)
+inline static size_t bucket_header_size_get()
 {
-    return (i << 1) + 1;
+    #ifdef KISSMALLOC_BALANCE_LINE
+    return bucket_balance_offset_get() + KISSMALLOC_CACHE_LINE_SIZE;
+    #else
+    return round_up_pow2(bucket_balance_offset_get() + KISSMALLOC_BALANCE_SIZE, KISSMALLOC_GRANULARITY);
+    #endif
 }
 
-inline static int cache_child_right(int i)
+/** Number of objects allocated minus number of objects freed, which gets decremented by each free() and
+  * reconciled with object_count when the owner retires the page (the page is free when the balance drops to zero)
+  */
+inline static int32_t *bucket_balance(struct bucket_t *bucket)
 {
-    return (i << 1) + 2;
+    return (int32_t *)((uint8_t *)bucket + bucket_balance_offset_get());
 }
 
-inline static int cache_min(struct bucket_t **buffer, int i, int j, int k)
+inline static void bucket_mark(struct bucket_t *bucket, const size_t offset)
 {
-    int m = i;
-
-    if (buffer[j] < buffer[k]) {
-        if (buffer[j] < buffer[i])
-            m = j;
-    }
-    else if (buffer[k] < buffer[i])
-        m = k;
-
-    return m;
+    const size_t i = offset >> KISSMALLOC_GRANULARITY_SHIFT;
+    bucket->object_map[i >> 5] |= (uint32_t)1 << (i & 31);
 }
 
-inline static void cache_bubble_up(struct cache_t *cache)
+/** Carve the next object of size bytes from the top of bucket
+  */
+inline static void *bucket_carve(struct bucket_t *bucket, const size_t page_size, const size_t size)
 {
-    struct bucket_t **buffer = cache->buffer;
-    for (int i = cache->fill - 1; i > 0;) {
-        int j = cache_parent(i);
-        if (buffer[i] >= buffer[j]) break;
-        cache_xchg(buffer, i, j);
-        i = j;
-    }
+    const size_t offset = page_size - bucket->bytes_free;
+    bucket_mark(bucket, offset);
+    __atomic_store_n(&bucket->bytes_free, bucket->bytes_free - size, __ATOMIC_RELEASE); // publish the mark before the new top
+    ++bucket->object_count;
+    return (uint8_t *)bucket + offset;
 }
 
-inline static void cache_bubble_down(struct cache_t *cache)
+/** Offset of the end of the object at offset, which is either the start of the next object or top
+  */
+inline static size_t bucket_object_end(const struct bucket_t *bucket, const size_t offset, const size_t top)
 {
-    const int fill = cache->fill;
-    struct bucket_t **buffer = cache->buffer;
-    if (fill == 0) return;
-    for (int i = 0; 1;) {
-        int lc = cache_child_left(i);
-        int rc = cache_child_right(i);
-        if (rc < fill) {
-            int j = cache_min(buffer, i, lc, rc);
-            if (j == i) break;
-            cache_xchg(buffer, i, j);
-            i = j;
-        }
-        else if (lc < fill) {
-            if (buffer[lc] < buffer[i])
-                cache_xchg(buffer, i, lc);
-            break;
+    size_t i = (offset >> KISSMALLOC_GRANULARITY_SHIFT) + 1;
+    const size_t n = top >> KISSMALLOC_GRANULARITY_SHIFT;
+    while (i < n) {
+        const uint32_t word = bucket->object_map[i >> 5] >> (i & 31);
+        if (word != 0) {
+            i += __builtin_ctz(word);
+            return (i < n) ? i << KISSMALLOC_GRANULARITY_SHIFT : top;
         }
-        else
-            break;
+        i = (i | 31) + 1;
     }
+    return top;
 }
 
-inline static struct bucket_t *cache_pop(struct cache_t *cache)
+#ifdef KISSMALLOC_REUSE
+
+inline static struct bucket_reuse_t *bucket_reuse(struct bucket_t *bucket)
 {
-    struct bucket_t *page = cache->buffer[0];
-    --cache->fill;
-    cache->buffer[0] = cache->buffer[cache->fill];
-    cache_bubble_down(cache);
-    return page;
+    return (struct bucket_reuse_t *)((uint8_t *)bucket + bucket_balance_offset_get() + sizeof(int64_t));
 }
 
-static void cache_reduce(struct cache_t *cache, uint32_t fill_max)
+inline static void *bucket_reuse_pop(struct bucket_t *bucket)
 {
-    if (cache->fill <= fill_max) return;
-
-    const size_t page_size = page_size_get();
+    struct bucket_reuse_t *reuse = bucket_reuse(bucket);
+    void *data = reuse->free_list;
+    reuse->free_list = *(void **)data;
+    --reuse->free_count;
+    return data;
+}
 
-    void *chunk = cache_pop(cache);
-    size_t size = page_size_get();
+#endif // KISSMALLOC_REUSE
 
-    while (cache->fill > fill_max) {
-        void *chunk2 = cache_pop(cache);
-        if ((uint8_t *)chunk2 - (uint8_t *)chunk == (ssize_t)size) {
-            size += page_size;
-        }
-        else {
-            if (munmap(chunk, size) == -1) abort();
-            chunk = chunk2;
-            size = page_size;
-        }
-    }
+#ifdef KISSMALLOC_SIZE_CLASSES
 
-    if (size > 0) {
-        if (munmap(chunk, size) == -1) abort();
-    }
+inline static int size_class_index(const size_t size)
+{
+    const size_t s = size - 1;
+    if (s < 8 * KISSMALLOC_GRANULARITY) return s >> KISSMALLOC_GRANULARITY_SHIFT;
+    const int e = 8 * sizeof(long) - 1 - __builtin_clzl(s);
+    return 8 + ((e - KISSMALLOC_GRANULARITY_SHIFT - 3) << 2) + ((s >> (e - 2)) & 3);
 }
 
-inline static size_t cache_size_get()
+inline static size_t size_class_size(const int class_index)
 {
-    return round_up_pow2(sizeof(struct cache_t), page_size_get());
+    if (class_index < 8) return (size_t)(class_index + 1) << KISSMALLOC_GRANULARITY_SHIFT;
+    const int k = class_index - 8;
+    const int e = k >> 2;
+    return ((8 * KISSMALLOC_GRANULARITY) << e) + (size_t)((k & 3) + 1) * ((2 * KISSMALLOC_GRANULARITY) << e);
 }
 
-static struct cache_t *cache_create()
+#endif // KISSMALLOC_SIZE_CLASSES
+
+static size_t map_count = 0; // not maintained if KISSMALLOC_PAGE_RELEASE == 0 (see memmaps())
+
+inline static void map_count_add(ssize_t delta)
 {
-    struct cache_t *cache = (struct cache_t *)mmap(NULL, cache_size_get(), PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-    if (cache == MAP_FAILED) abort();
-    return cache;
+    #if KISSMALLOC_PAGE_RELEASE > 0
+    __sync_add_and_fetch(&map_count, delta);
+    #else
+    (void)delta;
+    #endif
 }
 
-static void cache_cleanup(struct cache_t *cache)
+/** Memory usage is spread over several counters, which are picked by a hash of the calling thread,
+  * and so are the page counters, which are updated by page operations, and the counters of kissmalloc_stats()
+  */
+struct usage_shard_t {
+    size_t bytes;
+    size_t pages_live; // pages taken for allocation and not yet handed back
+    size_t pages_cached; // freed pages kept in page caches
+    size_t pages_prealloc; // untouched pages of preallocated runs
+    size_t pages_released; // pages handed back by cache_reduce()
+    size_t large_count; // large blocks in use
+    size_t large_bytes;
+    size_t zone_count;
+    size_t mapped_bytes;
+    size_t mmap_calls;
+    size_t munmap_calls;
+    size_t madvise_calls;
+    size_t mremap_calls;
+} __attribute__((aligned(KISSMALLOC_CACHE_LINE_SIZE)));
+
+static struct usage_shard_t usage_shard[KISSMALLOC_USAGE_SHARDS];
+
+static size_t mapped_peak = 0; // highest sum of the mapped bytes of all shards seen when mapping memory
+
+inline static struct usage_shard_t *usage_shard_get()
 {
-    cache_reduce(cache, 0);
-    if (munmap(cache, cache_size_get()) == -1) abort();
+    #if KISSMALLOC_USAGE_SHARDS > 1
+    const uint64_t hash = (uint64_t)pthread_self() * UINT64_C(0x9E3779B97F4A7C15);
+    return &usage_shard[hash >> (64 - __builtin_ctz(KISSMALLOC_USAGE_SHARDS))];
+    #else
+    return &usage_shard[0];
+    #endif
 }
 
-static void cache_push(struct cache_t *cache, struct bucket_t *page, size_t page_size)
+inline static void stats_add(size_t *counter, size_t delta)
 {
-    if (cache->fill == KISSMALLOC_PAGE_CACHE)
-        cache_reduce(cache, KISSMALLOC_PAGE_CACHE >> 1);
-
-    cache->buffer[cache->fill] = page;
-    ++cache->fill;
-    cache_bubble_up(cache);
+    __atomic_fetch_add(counter, delta, __ATOMIC_RELAXED);
 }
 
-static pthread_once_t library_init_control = PTHREAD_ONCE_INIT;
-static pthread_key_t bucket_key = -1;
-static pthread_key_t source_key = -1;
-
-static size_t usage_total = 0;
-
-static void bucket_cleanup(void *arg)
+inline static void pages_add(const ssize_t live, const ssize_t cached, const ssize_t prealloc)
 {
-    struct bucket_t *bucket = (struct bucket_t *)arg;
-
-    if (bucket) {
-        const size_t page_size = page_size_get();
-
-        void *head = bucket;
-        size_t size = (bucket->cache->prealloc_count + 1) * page_size;
+    struct usage_shard_t *shard = usage_shard_get();
+    if (live != 0) stats_add(&shard->pages_live, live);
+    if (cached != 0) stats_add(&shard->pages_cached, cached);
+    if (prealloc != 0) stats_add(&shard->pages_prealloc, prealloc);
+}
 
-        cache_cleanup(bucket->cache);
+/** Limits, which can be lowered at runtime by mallopt()
+  */
+struct tuning_t {
+    uint32_t page_cache; // cached pages per zone at maximum (M_TRIM_THRESHOLD)
+    uint32_t page_prealloc; // pages preallocated beyond the page needed right now at maximum (M_TOP_PAD)
+    size_t large_cache; // largest mapping kept in the large allocation cache (M_MMAP_THRESHOLD)
+};
 
-        if (__sync_sub_and_fetch(&bucket->object_count, 1)) {
-            head = ((uint8_t *)head) + page_size;
-            size -= page_size;
-        }
+static struct tuning_t tuning = { KISSMALLOC_PAGE_CACHE, UINT32_MAX, KISSMALLOC_LARGE_CACHE };
 
-        if (munmap(head, size) == -1) abort();
-    }
+inline static size_t mapped_sum()
+{
+    size_t mapped = 0;
+    for (int i = 0; i < KISSMALLOC_USAGE_SHARDS; ++i)
+        mapped += __atomic_load_n(&usage_shard[i].mapped_bytes, __ATOMIC_RELAXED);
+    return mapped;
 }
 
-static void library_init()
+static void mapped_add(struct usage_shard_t *shard, size_t delta)
 {
-    if (pthread_key_create(&bucket_key, bucket_cleanup) != 0) abort();
-    if (pthread_key_create(&source_key, NULL) != 0) abort();
+    stats_add(&shard->mapped_bytes, delta);
+    if ((ssize_t)delta <= 0) return;
+    const size_t mapped = mapped_sum();
+    size_t peak = __atomic_load_n(&mapped_peak, __ATOMIC_RELAXED);
+    while (peak < mapped && !__atomic_compare_exchange_n(&mapped_peak, &peak, mapped, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
-inline static void usage_add(size_t delta)
+inline static void *sys_mmap(const size_t size)
 {
-    uint8_t *source = (uint8_t *)pthread_getspecific(source_key);
-    source += delta;
-    pthread_setspecific(source_key, source);
-    __sync_add_and_fetch(&usage_total, delta);
+    struct usage_shard_t *shard = usage_shard_get();
+    stats_add(&shard->mmap_calls, 1);
+    void *start = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    if (start != MAP_FAILED) mapped_add(shard, size);
+    return start;
 }
 
-static struct bucket_t *bucket_create_initial(const size_t page_size)
+inline static int sys_munmap(void *start, const size_t size)
 {
-    void *page_start = mmap(NULL, KISSMALLOC_PAGE_PREALLOC * page_size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-    if (page_start == MAP_FAILED) abort();
+    struct usage_shard_t *shard = usage_shard_get();
+    stats_add(&shard->munmap_calls, 1);
+    const int ret = munmap(start, size);
+    if (ret == 0) mapped_add(shard, -size);
+    return ret;
+}
 
-    struct cache_t *cache = cache_create();
-    cache->prealloc_count = KISSMALLOC_PAGE_PREALLOC - 1;
+inline static int sys_madvise(void *start, const size_t size, const int advice)
+{
+    stats_add(&usage_shard_get()->madvise_calls, 1);
+    return madvise(start, size, advice);
+}
 
-    const size_t bucket_header_size = round_up_pow2(sizeof(struct bucket_t), KISSMALLOC_GRANULARITY);
-    struct bucket_t *bucket = (struct bucket_t *)page_start;
-    bucket->bytes_free = page_size - bucket_header_size;
-    bucket->object_count = 1;
-    bucket->cache = cache;
+#ifdef MREMAP_MAYMOVE
 
-    pthread_once(&library_init_control, library_init);
-    pthread_setspecific(bucket_key, bucket);
+inline static void *sys_mremap(void *old_start, const size_t old_size, const size_t new_size, const int flags)
+{
+    struct usage_shard_t *shard = usage_shard_get();
+    stats_add(&shard->mremap_calls, 1);
+    void *new_start = mremap(old_start, old_size, new_size, flags);
+    if (new_start != MAP_FAILED) mapped_add(shard, new_size - old_size);
+    return new_start;
+}
 
-    usage_add(page_size);
+#endif
 
-    return bucket;
+inline static void large_stats_add(const ssize_t count, const size_t bytes)
+{
+    struct usage_shard_t *shard = usage_shard_get();
+    if (count != 0) stats_add(&shard->large_count, count);
+    stats_add(&shard->large_bytes, bytes);
 }
 
-static void *bucket_advance(struct bucket_t *bucket, const size_t page_size, const size_t item_size)
-{
-    uint32_t prealloc_count = bucket->cache->prealloc_count;
-    struct cache_t *cache = bucket->cache;
+#define KISSMALLOC_NUMA_NODES_MAX (8 * (int)sizeof(unsigned long))
 
-    if (!__sync_sub_and_fetch(&bucket->object_count, 1)) {
-        cache_push(bucket->cache, bucket, page_size);
-        usage_add(-page_size);
-    }
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
 
-    void *page_start = NULL;
-    if (prealloc_count > 0) {
-        page_start = (uint8_t *)bucket + page_size;
-        --prealloc_count;
-    }
-    else {
-        page_start = mmap(NULL, KISSMALLOC_PAGE_PREALLOC * page_size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-        if (page_start == MAP_FAILED) {
-            errno = ENOMEM;
-            return NULL;
+static int numa_node_count_get()
+{
+    static int node_count = 0;
+    if (node_count > 0) return node_count;
+
+    int count = 1;
+    const int fd = open("/sys/devices/system/node/possible", O_RDONLY|O_CLOEXEC); // e.g. "0-3"
+    if (fd != -1) {
+        char text[64];
+        const ssize_t n = read(fd, text, sizeof(text) - 1);
+        close(fd);
+        if (n > 0) {
+            int last = 0;
+            for (ssize_t i = 0; i < n; ++i) {
+                if ('0' <= text[i] && text[i] <= '9') last = last * 10 + text[i] - '0';
+                else if (text[i] == ',' || text[i] == '-') last = 0;
+            }
+            count = last + 1;
         }
-
-        prealloc_count = KISSMALLOC_PAGE_PREALLOC - 1;
     }
+    if (count > KISSMALLOC_NUMA_NODES_MAX) count = KISSMALLOC_NUMA_NODES_MAX;
 
-    cache->prealloc_count = prealloc_count;
+    node_count = count;
+    return count;
+}
 
-    const size_t bucket_header_size = round_up_pow2(sizeof(struct bucket_t), KISSMALLOC_GRANULARITY);
+#ifdef KISSMALLOC_NUMA
 
-    bucket = (struct bucket_t *)page_start;
-    bucket->bytes_free = page_size - bucket_header_size - item_size;
-    bucket->object_count = 2;
-    bucket->cache = cache;
+/** NUMA node of the calling thread's current CPU
+  */
+static int numa_node_get()
+{
+    #ifdef SYS_getcpu
+    if (numa_node_count_get() > 1) {
+        unsigned cpu = 0, node = 0;
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && (int)node < numa_node_count_get()) return node;
+    }
+    #endif
+    return 0;
+}
+
+#endif // KISSMALLOC_NUMA
+
+/** Ask the kernel to place the pages of the given range on node (silently ignored on single node systems)
+  */
+static void numa_bind(void *start, const size_t size, const int node)
+{
+    #ifdef SYS_mbind
+    if (numa_node_count_get() > 1) {
+        const unsigned long node_mask = 1UL << node;
+        syscall(SYS_mbind, start, size, MPOL_PREFERRED, &node_mask, 8 * sizeof(node_mask) + 1, 0);
+    }
+    #endif
+}
+
+/** Map size bytes, such that the mapping start plus offset is a multiple of alignment
+  */
+static void *map_aligned(const size_t size, const size_t alignment, const size_t offset)
+{
+    const size_t page_size = page_size_get();
+
+    if (alignment <= page_size && (offset & (alignment - 1)) == 0) {
+        void *map_start = sys_mmap(size);
+        return (map_start != MAP_FAILED) ? map_start : NULL;
+    }
+
+    const size_t map_size = size + alignment - page_size;
+
+    uint8_t *map_start = (uint8_t *)sys_mmap(map_size);
+    if (map_start == MAP_FAILED) return NULL;
+
+    uint8_t *start = (uint8_t *)round_up_pow2((size_t)(map_start + offset - (uint8_t *)NULL), alignment) - offset;
+    uint8_t *end = start + size;
+    uint8_t *map_end = map_start + map_size;
+
+    if (start > map_start) {
+        if (sys_munmap(map_start, start - map_start) == -1) abort();
+    }
+    if (map_end > end) {
+        if (sys_munmap(end, map_end - end) == -1) abort();
+    }
+
+    return start;
+}
+
+inline static size_t run_page_count_get(const size_t page_size)
+{
+    #ifdef KISSMALLOC_HUGEPAGE
+    if (KISSMALLOC_PAGE_PREALLOC * page_size < KISSMALLOC_HUGEPAGE_SIZE) return KISSMALLOC_HUGEPAGE_SIZE / page_size;
+    #endif
+    return KISSMALLOC_PAGE_PREALLOC;
+}
+
+inline static size_t run_size_get(const size_t page_size)
+{
+    return run_page_count_get(page_size) * page_size;
+}
+
+#if KISSMALLOC_PAGE_RELEASE > 0
+
+/** A preallocated run is aligned to its size (rounded up to a power of two), so that any page can find the run
+  * it belongs to. The first page of the run is reserved for the run header, which counts the released pages.
+  */
+struct run_t {
+    uint32_t release_count;
+};
+
+inline static size_t run_alignment_get(const size_t page_size)
+{
+    return (size_t)1 << (8 * sizeof(long) - __builtin_clzl(run_size_get(page_size) - 1));
+}
+
+static void run_release(void *chunk, uint32_t page_count, const size_t page_size)
+{
+    struct run_t *run = (struct run_t *)((size_t)((uint8_t *)chunk - (uint8_t *)NULL) & ~(run_alignment_get(page_size) - 1));
+
+    if (__sync_add_and_fetch(&run->release_count, page_count) == run_page_count_get(page_size) - 1) {
+        if (sys_munmap(run, run_size_get(page_size)) == -1) abort();
+        map_count_add(-1);
+    }
+}
+
+#else
+
+inline static size_t run_alignment_get(const size_t page_size)
+{
+    #ifdef KISSMALLOC_HUGEPAGE
+    return KISSMALLOC_HUGEPAGE_SIZE;
+    #else
+    return page_size;
+    #endif
+}
+
+#endif // KISSMALLOC_PAGE_RELEASE > 0
+
+/** Number of pages to map for the next preallocated run: the page to hand out right now and the further pages allowed
+  * by mallopt(M_TOP_PAD), but at least KISSMALLOC_RUN_MIN pages (the madvise policies need full runs to find the run
+  * header of a page)
+  */
+inline static size_t run_page_count_next(const size_t page_size)
+{
+    const size_t page_count = run_page_count_get(page_size);
+    #if KISSMALLOC_PAGE_RELEASE == 0
+    const size_t pad = __atomic_load_n(&tuning.page_prealloc, __ATOMIC_RELAXED);
+    if (pad < page_count - 1) return (pad + 1 > KISSMALLOC_RUN_MIN) ? pad + 1 : KISSMALLOC_RUN_MIN;
+    #endif
+    return page_count;
+}
+
+/** Map a preallocated run of page_count pages
+  */
+static void *run_map(const size_t page_count, const size_t page_size)
+{
+    const int full = (page_count == run_page_count_get(page_size)); // shorter runs are neither aligned nor huge
+
+    void *run = map_aligned(page_count * page_size, full ? run_alignment_get(page_size) : page_size, 0);
+    if (run == NULL) return NULL;
+
+    #if defined(KISSMALLOC_HUGEPAGE) && defined(MADV_HUGEPAGE)
+    if (full) sys_madvise(run, page_count * page_size, MADV_HUGEPAGE); // may fail if transparent huge pages are disabled
+    #endif
+
+    map_count_add(1);
+
+    return run;
+}
+
+static void *large_map(const size_t size, const size_t page_size)
+{
+    #ifdef KISSMALLOC_HUGEPAGE
+    if (size - page_size >= KISSMALLOC_HUGEPAGE_SIZE) {
+        uint8_t *head = (uint8_t *)map_aligned(size, KISSMALLOC_HUGEPAGE_SIZE, page_size);
+        if (head == NULL) return NULL;
+        #ifdef MADV_HUGEPAGE
+        sys_madvise(head + page_size, size - page_size, MADV_HUGEPAGE);
+        #endif
+        map_count_add(1);
+        return head;
+    }
+    #endif
+
+    void *head = map_aligned(size, page_size, 0);
+    if (head == NULL) return NULL;
+    map_count_add(1);
+    return head;
+}
+
+#if KISSMALLOC_LARGE_CACHE > 0
+
+inline static int large_cache_bin(const size_t size)
+{
+    return 8 * sizeof(long) - 1 - __builtin_clzl(size);
+}
+
+static void large_cache_remove(struct large_cache_t *large, const int bin, const int i)
+{
+    large->size_total -= large->entry[bin][i].size;
+    --large->fill[bin];
+    large->entry[bin][i] = large->entry[bin][large->fill[bin]];
+}
+
+static void large_cache_evict(struct large_cache_t *large, const int bin, const int i)
+{
+    if (sys_munmap(large->entry[bin][i].head, large->entry[bin][i].size) == -1) abort();
+    map_count_add(-1);
+    large_cache_remove(large, bin, i);
+}
+
+/** Unmap all entries, which have not been reused within the last decay_ticks cache operations
+  */
+static void large_cache_decay(struct large_cache_t *large, const uint32_t decay_ticks)
+{
+    if (large->size_total == 0) return;
+
+    for (int bin = 0; bin < (int)KISSMALLOC_LARGE_CACHE_BINS; ++bin) {
+        for (int i = large->fill[bin] - 1; i >= 0; --i) {
+            if (large->tick - large->entry[bin][i].tick >= decay_ticks)
+                large_cache_evict(large, bin, i);
+        }
+    }
+}
+
+static void large_cache_evict_oldest(struct large_cache_t *large)
+{
+    int bin_oldest = -1;
+    int i_oldest = -1;
+    uint32_t age_oldest = 0;
+
+    for (int bin = 0; bin < (int)KISSMALLOC_LARGE_CACHE_BINS; ++bin) {
+        for (int i = 0; i < large->fill[bin]; ++i) {
+            const uint32_t age = large->tick - large->entry[bin][i].tick;
+            if (bin_oldest < 0 || age > age_oldest) {
+                bin_oldest = bin;
+                i_oldest = i;
+                age_oldest = age;
+            }
+        }
+    }
+
+    if (bin_oldest >= 0) large_cache_evict(large, bin_oldest, i_oldest);
+}
+
+/** Take a cached mapping of at least size and at most 2 * size bytes
+  */
+static uint8_t *large_cache_get(struct large_cache_t *large, const size_t size)
+{
+    ++large->tick;
+
+    if (large->size_total == 0) return NULL;
+
+    const int bin = large_cache_bin(size);
+
+    for (int b = bin; b <= bin + 1 && b < (int)KISSMALLOC_LARGE_CACHE_BINS; ++b) {
+        for (int i = 0; i < large->fill[b]; ++i) {
+            struct large_entry_t *entry = &large->entry[b][i];
+            if (size <= entry->size && entry->size <= 2 * size) {
+                uint8_t *head = entry->head;
+                large_cache_remove(large, b, i);
+                return head;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/** Keep a mapping for later reuse, returns 0 if the mapping does not fit into the cache
+  */
+static int large_cache_put(struct large_cache_t *large, uint8_t *head, const size_t size)
+{
+    if (size > __atomic_load_n(&tuning.large_cache, __ATOMIC_RELAXED)) return 0;
+
+    ++large->tick;
+
+    large_cache_decay(large, KISSMALLOC_LARGE_CACHE_DECAY);
+
+    const int bin = large_cache_bin(size);
+
+    while (large->fill[bin] == KISSMALLOC_LARGE_CACHE_BIN_SIZE || large->size_total + size > KISSMALLOC_LARGE_CACHE)
+        large_cache_evict_oldest(large);
+
+    struct large_entry_t *entry = &large->entry[bin][large->fill[bin]];
+    entry->head = head;
+    entry->size = size;
+    entry->tick = large->tick;
+    ++large->fill[bin];
+    large->size_total += size;
+
+    return 1;
+}
+
+#endif // KISSMALLOC_LARGE_CACHE > 0
+
+static void chunk_release(void *chunk, size_t size, const size_t page_size)
+{
+    #if KISSMALLOC_PAGE_RELEASE == 0
+    if (sys_munmap(chunk, size) == -1) abort();
+    #else
+    int ret = -1;
+    #if KISSMALLOC_PAGE_RELEASE == 2
+    ret = sys_madvise(chunk, size, MADV_FREE); // fails on kernels, which do not support MADV_FREE
+    #endif
+    if (ret == -1) {
+        if (sys_madvise(chunk, size, MADV_DONTNEED) == -1) abort();
+    }
+    run_release(chunk, size / page_size, page_size);
+    #endif
+}
+
+/** Lock the page cache, the preallocated run and the large cache of a zone for a page operation of its owner
+  *
+  * The locks of the allocator are only ever taken in this order:
+  *   1. the lock of a per-CPU zone (struct cpu_zone_t, KISSMALLOC_PER_CPU), at most one at a time
+  *   2. the registry lock (cache_registry_lock, KISSMALLOC_DECAY)
+  *   3. the lock of a zone's cache (cache_lock()), at most one at a time
+  * fork_prepare() takes all per-CPU zone locks and then all cache locks in registry order, which is fine as long as
+  * everybody else holds at most one lock of each kind. No lock is held while calling pthread_create(3) (see decay_start()).
+  */
+inline static void cache_lock(struct cache_t *cache)
+{
+    #ifdef KISSMALLOC_DECAY
+    while (__sync_lock_test_and_set(&cache->lock, 1)) sched_yield();
+    ++cache->tick;
+    #else
+    (void)cache;
+    #endif
+}
+
+inline static void cache_unlock(struct cache_t *cache)
+{
+    #ifdef KISSMALLOC_DECAY
+    __sync_lock_release(&cache->lock);
+    #else
+    (void)cache;
+    #endif
+}
+
+inline static void cache_xchg(struct bucket_t **buffer, int i, int j)
+{
+    struct bucket_t *h = buffer[i];
+    buffer[i] = buffer[j];
+    buffer[j] = h;
+}
+
+inline static int cache_parent(int i)
+{
+    return (i - 1) >> 1;
+}
+
+inline static int cache_child_left(int i)
+{
+    return (i << 1) + 1;
+}
+
+inline static int cache_child_right(int i)
+{
+    return (i << 1) + 2;
+}
+
+inline static int cache_min(struct bucket_t **buffer, int i, int j, int k)
+{
+    int m = i;
+
+    if (buffer[j] < buffer[k]) {
+        if (buffer[j] < buffer[i])
+            m = j;
+    }
+    else if (buffer[k] < buffer[i])
+        m = k;
+
+    return m;
+}
+
+inline static void cache_bubble_up(struct cache_t *cache)
+{
+    struct bucket_t **buffer = cache->buffer;
+    for (int i = cache->fill - 1; i > 0;) {
+        int j = cache_parent(i);
+        if (buffer[i] >= buffer[j]) break;
+        cache_xchg(buffer, i, j);
+        i = j;
+    }
+}
+
+inline static void cache_bubble_down(struct cache_t *cache)
+{
+    const int fill = cache->fill;
+    struct bucket_t **buffer = cache->buffer;
+    if (fill == 0) return;
+    for (int i = 0; 1;) {
+        int lc = cache_child_left(i);
+        int rc = cache_child_right(i);
+        if (rc < fill) {
+            int j = cache_min(buffer, i, lc, rc);
+            if (j == i) break;
+            cache_xchg(buffer, i, j);
+            i = j;
+        }
+        else if (lc < fill) {
+            if (buffer[lc] < buffer[i])
+                cache_xchg(buffer, i, lc);
+            break;
+        }
+        else
+            break;
+    }
+}
+
+inline static struct bucket_t *cache_pop(struct cache_t *cache)
+{
+    struct bucket_t *page = cache->buffer[0];
+    --cache->fill;
+    cache->buffer[0] = cache->buffer[cache->fill];
+    cache_bubble_down(cache);
+    return page;
+}
+
+static void cache_reduce(struct cache_t *cache, uint32_t fill_max)
+{
+    if (cache->fill <= fill_max) return;
+
+    pages_add(0, -(ssize_t)(cache->fill - fill_max), 0);
+    stats_add(&usage_shard_get()->pages_released, cache->fill - fill_max);
+
+    const size_t page_size = page_size_get();
+
+    void *chunk = cache_pop(cache);
+    size_t size = page_size_get();
+
+    while (cache->fill > fill_max) {
+        void *chunk2 = cache_pop(cache);
+        if ((uint8_t *)chunk2 - (uint8_t *)chunk == (ssize_t)size) {
+            size += page_size;
+        }
+        else {
+            chunk_release(chunk, size, page_size);
+            chunk = chunk2;
+            size = page_size;
+        }
+    }
+
+    if (size > 0) chunk_release(chunk, size, page_size);
+}
+
+inline static size_t cache_size_get()
+{
+    return round_up_pow2(sizeof(struct cache_t), page_size_get());
+}
+
+static void cache_push(struct cache_t *cache, struct bucket_t *page, size_t page_size)
+{
+    cache_lock(cache);
+
+    const uint32_t fill_max = __atomic_load_n(&tuning.page_cache, __ATOMIC_RELAXED);
+    if (cache->fill >= fill_max)
+        cache_reduce(cache, fill_max >> 1);
+
+    cache->buffer[cache->fill] = page;
+    ++cache->fill;
+    cache_bubble_up(cache);
+
+    pages_add(-1, 1, 0);
+
+    cache_unlock(cache);
+}
+
+/** Hand back the unused remainder of the preallocated run of a zone
+  */
+static void cache_prealloc_release(struct cache_t *cache, const size_t page_size)
+{
+    if (cache->prealloc_count > 0) {
+        pages_add(0, 0, -(ssize_t)cache->prealloc_count);
+        #if KISSMALLOC_PAGE_RELEASE == 0
+        if (sys_munmap(cache->prealloc_next, cache->prealloc_count * page_size) == -1) abort();
+        #else
+        run_release(cache->prealloc_next, cache->prealloc_count, page_size);
+        #endif
+        cache->prealloc_count = 0;
+        cache->prealloc_next = NULL;
+    }
+}
+
+/** Hand back all but fill_max cached pages, the unused preallocated pages and the cached large mappings of a zone
+  * (the zone needs to be locked by the caller, returns 1 if any memory has been handed back)
+  */
+static int cache_trim(struct cache_t *cache, const uint32_t fill_max, const size_t page_size)
+{
+    int released = (cache->fill > fill_max || cache->prealloc_count > 0);
+
+    cache_reduce(cache, fill_max);
+    cache_prealloc_release(cache, page_size);
+
+    #if KISSMALLOC_LARGE_CACHE > 0
+    if (cache->large.size_total > 0) {
+        large_cache_decay(&cache->large, 0);
+        released = 1;
+    }
+    #endif
+
+    return released;
+}
+
+#ifdef KISSMALLOC_REMOTE_FREE
+
+inline static struct bucket_t **bucket_link(struct bucket_t *page)
+{
+    return (struct bucket_t **)((uint8_t *)page + bucket_header_size_get());
+}
+
+static void cache_remote_push(struct cache_t *cache, struct bucket_t *page)
+{
+    struct bucket_t *head = __atomic_load_n(&cache->remote, __ATOMIC_RELAXED);
+    do {
+        *bucket_link(page) = head;
+    } while (!__atomic_compare_exchange_n(&cache->remote, &head, page, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void cache_remote_drain(struct cache_t *cache, const size_t page_size)
+{
+    if (__atomic_load_n(&cache->remote, __ATOMIC_RELAXED) == NULL) return;
+
+    struct bucket_t *page = __atomic_exchange_n(&cache->remote, NULL, __ATOMIC_ACQUIRE);
+    while (page) {
+        struct bucket_t *next = *bucket_link(page);
+        cache_push(cache, page, page_size);
+        page = next;
+    }
+}
+
+#endif // KISSMALLOC_REMOTE_FREE
+
+#ifdef KISSMALLOC_DEPOT
+
+#ifdef KISSMALLOC_NUMA
+#define KISSMALLOC_DEPOT_COUNT KISSMALLOC_NUMA_NODES_MAX // one depot per node, so that threads only adopt zones of their node
+#else
+#define KISSMALLOC_DEPOT_COUNT 1
+#endif
+
+/// tops of the depot stacks, the low bits carry a tag against ABA (zones are page aligned)
+static uintptr_t cache_depot[KISSMALLOC_DEPOT_COUNT];
+
+static void cache_depot_push(struct cache_t *cache)
+{
+    #ifdef KISSMALLOC_NUMA
+    uintptr_t *depot = &cache_depot[cache->node];
+    #else
+    uintptr_t *depot = &cache_depot[0];
+    #endif
+    const uintptr_t tag_mask = page_size_get() - 1;
+    uintptr_t head = __atomic_load_n(depot, __ATOMIC_RELAXED);
+    uintptr_t head_new = 0;
+    do {
+        __atomic_store_n(&cache->depot_next, (struct cache_t *)(head & ~tag_mask), __ATOMIC_RELAXED);
+        head_new = (uintptr_t)cache | ((head + 1) & tag_mask);
+    } while (!__atomic_compare_exchange_n(depot, &head, head_new, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/** Take a zone from the depot of the given node (0 without KISSMALLOC_NUMA)
+  */
+static struct cache_t *cache_depot_pop(const int node)
+{
+    uintptr_t *depot = &cache_depot[node];
+    const uintptr_t tag_mask = page_size_get() - 1;
+    uintptr_t head = __atomic_load_n(depot, __ATOMIC_ACQUIRE);
+    while ((head & ~tag_mask) != 0) {
+        struct cache_t *cache = (struct cache_t *)(head & ~tag_mask);
+        const uintptr_t head_new = (uintptr_t)__atomic_load_n(&cache->depot_next, __ATOMIC_RELAXED) | ((head + 1) & tag_mask);
+            // zones are never unmapped, so reading a stale link is harmless (the tag makes the exchange fail then)
+        if (__atomic_compare_exchange_n(depot, &head, head_new, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) return cache;
+    }
+    return NULL;
+}
+
+#endif // KISSMALLOC_DEPOT
+
+#ifdef KISSMALLOC_DECAY
+
+static struct cache_t *cache_registry = NULL;
+static char cache_registry_lock = 0;
+
+static void cache_register(struct cache_t *cache)
+{
+    while (__sync_lock_test_and_set(&cache_registry_lock, 1)) sched_yield();
+    cache->registry_prev = NULL;
+    cache->registry_next = cache_registry;
+    if (cache_registry) cache_registry->registry_prev = cache;
+    cache_registry = cache;
+    __sync_lock_release(&cache_registry_lock);
+}
+
+#ifndef KISSMALLOC_DEPOT
+
+static void cache_unregister(struct cache_t *cache)
+{
+    while (__sync_lock_test_and_set(&cache_registry_lock, 1)) sched_yield();
+    if (cache->registry_prev) cache->registry_prev->registry_next = cache->registry_next;
+    else cache_registry = cache->registry_next;
+    if (cache->registry_next) cache->registry_next->registry_prev = cache->registry_prev;
+    __sync_lock_release(&cache_registry_lock);
+}
+
+#endif
+
+#endif // KISSMALLOC_DECAY
+
+static struct cache_t *cache_create()
+{
+    #ifdef KISSMALLOC_DEPOT
+    #ifdef KISSMALLOC_NUMA
+    struct cache_t *cache_adopted = cache_depot_pop(numa_node_get());
+    #else
+    struct cache_t *cache_adopted = cache_depot_pop(0);
+    #endif
+    if (cache_adopted != NULL) return cache_adopted;
+    #endif
+
+    struct cache_t *cache = (struct cache_t *)sys_mmap(cache_size_get());
+    if (cache == MAP_FAILED) abort();
+    map_count_add(1);
+    stats_add(&usage_shard_get()->zone_count, 1);
+    #ifdef KISSMALLOC_NUMA
+    cache->node = numa_node_get();
+    #endif
+    #ifdef KISSMALLOC_DECAY
+    cache_register(cache);
+    #endif
+    return cache;
+}
+
+static void cache_cleanup(struct cache_t *cache)
+{
+    #ifdef KISSMALLOC_REMOTE_FREE
+    cache_remote_drain(cache, page_size_get());
+    #endif
+
+    #ifndef KISSMALLOC_ZONE_DEPOT
+    cache_lock(cache);
+    cache_reduce(cache, 0);
+    cache_unlock(cache);
+    #endif
+
+    #ifdef KISSMALLOC_DEPOT
+    #ifdef KISSMALLOC_SIZE_CLASSES
+    memset(cache->class_bucket, 0, sizeof(cache->class_bucket));
+    #endif
+    cache_depot_push(cache);
+    #else
+    #ifdef KISSMALLOC_DECAY
+    cache_unregister(cache);
+    #endif
+    if (sys_munmap(cache, cache_size_get()) == -1) abort();
+    map_count_add(-1);
+    stats_add(&usage_shard_get()->zone_count, -1);
+    #endif
+}
+
+static pthread_once_t library_init_control = PTHREAD_ONCE_INIT;
+static pthread_key_t bucket_key = -1;
+static pthread_key_t source_key = -1;
+
+#ifdef KISSMALLOC_TLS
+static __thread struct bucket_t *bucket_current __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread ssize_t source_current __attribute__((tls_model("initial-exec"))) = 0;
+#endif
+
+#ifdef KISSMALLOC_PER_CPU
+
+#include <sched.h>
+
+#ifdef __has_include
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#endif
+#endif
+
+struct cpu_zone_t {
+    char lock;
+    struct bucket_t *bucket;
+} __attribute__((aligned(KISSMALLOC_CACHE_LINE_SIZE)));
+
+static struct cpu_zone_t *cpu_zone = NULL;
+static int cpu_zone_count = 0;
+static int cpu_zone_used = 0; // number of zones handed out, can be lowered by mallopt(M_ARENA_MAX)
+
+inline static int cpu_id_get()
+{
+    #ifdef RSEQ_SIG
+    if (__rseq_size > 0) {
+        const struct rseq *area = (const struct rseq *)((uint8_t *)__builtin_thread_pointer() + __rseq_offset);
+        const int cpu_id = (int)__atomic_load_n(&area->cpu_id, __ATOMIC_RELAXED);
+        if (cpu_id >= 0) return cpu_id;
+    }
+    #endif
+    const int cpu_id = sched_getcpu();
+    return (cpu_id >= 0) ? cpu_id : 0;
+}
+
+#endif // KISSMALLOC_PER_CPU
+
+#ifndef KISSMALLOC_PER_CPU
+
+inline static struct bucket_t *bucket_current_get()
+{
+    #ifdef KISSMALLOC_TLS
+    return bucket_current;
+    #else
+    return (struct bucket_t *)pthread_getspecific(bucket_key);
+    #endif
+}
+
+#endif
+
+inline static void bucket_current_set(struct bucket_t *bucket)
+{
+    #if defined(KISSMALLOC_PER_CPU)
+    bucket->cache->cpu_zone->bucket = bucket; // the zone is locked by the caller
+    #elif defined(KISSMALLOC_TLS)
+    if (bucket_current == NULL) pthread_setspecific(bucket_key, bucket); // makes sure bucket_cleanup() gets called at thread exit
+    bucket_current = bucket;
+    #else
+    pthread_setspecific(bucket_key, bucket);
+    #endif
+}
+
+#if KISSMALLOC_USAGE_BATCH > 0
+static __thread ssize_t usage_pending = 0;
+#endif
+
+inline static void usage_flush()
+{
+    #if KISSMALLOC_USAGE_BATCH > 0
+    __atomic_fetch_add(&usage_shard_get()->bytes, usage_pending, __ATOMIC_RELAXED);
+    usage_pending = 0;
+    #endif
+}
+
+inline static void usage_add(size_t delta)
+{
+    #ifdef KISSMALLOC_TLS
+    source_current += delta;
+    #else
+    uint8_t *source = (uint8_t *)pthread_getspecific(source_key);
+    source += delta;
+    pthread_setspecific(source_key, source);
+    #endif
+    #if KISSMALLOC_USAGE_BATCH > 0
+    usage_pending += (ssize_t)delta;
+    if (usage_pending >= (ssize_t)KISSMALLOC_USAGE_BATCH || usage_pending <= -(ssize_t)KISSMALLOC_USAGE_BATCH) usage_flush();
+    #else
+    __atomic_fetch_add(&usage_shard_get()->bytes, delta, __ATOMIC_RELAXED);
+    #endif
+}
+
+#ifdef KISSMALLOC_NUMA
+static struct usage_shard_t numa_usage[KISSMALLOC_NUMA_NODES_MAX];
+#endif
+
+inline static void usage_add_onnode(size_t delta, const int node)
+{
+    usage_add(delta);
+    #ifdef KISSMALLOC_NUMA
+    __atomic_fetch_add(&numa_usage[node].bytes, delta, __ATOMIC_RELAXED);
+    #else
+    (void)node;
+    #endif
+}
+
+inline static int cache_node_get(const struct cache_t *cache)
+{
+    #ifdef KISSMALLOC_NUMA
+    return cache->node;
+    #else
+    (void)cache;
+    return 0;
+    #endif
+}
+
+/** NUMA node of a large block, which is stored in its header page next to the mapping size
+  */
+inline static int large_node_get(const void *head)
+{
+    #ifdef KISSMALLOC_NUMA
+    return *(const int *)((const uint8_t *)head + sizeof(size_t));
+    #else
+    (void)head;
+    return 0;
+    #endif
+}
+
+inline static void large_node_set(void *head, const int node)
+{
+    #ifdef KISSMALLOC_NUMA
+    *(int *)((uint8_t *)head + sizeof(size_t)) = node;
+    #else
+    (void)head;
+    (void)node;
+    #endif
+}
+
+static void *page_take(struct cache_t *cache, const size_t page_size)
+{
+    void *page_start = NULL;
+
+    #ifdef KISSMALLOC_REMOTE_FREE
+    cache_remote_drain(cache, page_size);
+    #endif
+
+    cache_lock(cache);
+
+    #ifdef KISSMALLOC_PAGE_RECYCLE
+    if (cache->fill > 0) {
+        page_start = cache_pop(cache);
+        #if KISSMALLOC_RECYCLE_ZERO == 0
+        memset(page_start, 0, page_size);
+        #elif KISSMALLOC_RECYCLE_ZERO == 1
+        if (sys_madvise(page_start, page_size, MADV_DONTNEED) == -1) abort();
+        #endif
+        pages_add(1, -1, 0);
+    }
+    else
+    #endif
+    if (cache->prealloc_count > 0) {
+        page_start = cache->prealloc_next;
+        cache->prealloc_next += page_size;
+        --cache->prealloc_count;
+        pages_add(1, 0, -1);
+    }
+    else {
+        const size_t run_page_count = run_page_count_next(page_size);
+
+        page_start = run_map(run_page_count, page_size);
+        if (page_start == NULL) {
+            cache_unlock(cache);
+            return NULL;
+        }
+
+        #ifdef KISSMALLOC_NUMA
+        numa_bind(page_start, run_page_count * page_size, cache->node);
+        #endif
+
+        uint32_t prealloc_count = run_page_count - 1;
+
+        #if KISSMALLOC_PAGE_RELEASE > 0
+        page_start = (uint8_t *)page_start + page_size; // skip the run header
+        --prealloc_count;
+        #endif
+
+        cache->prealloc_next = (uint8_t *)page_start + page_size;
+        cache->prealloc_count = prealloc_count;
+        pages_add(1, 0, prealloc_count);
+    }
+
+    cache_unlock(cache);
+
+    usage_add_onnode(page_size, cache_node_get(cache));
+
+    return page_start;
+}
+
+static struct bucket_t *bucket_create(struct cache_t *cache, const size_t page_size)
+{
+    struct bucket_t *bucket = (struct bucket_t *)page_take(cache, page_size);
+    if (bucket == NULL) return NULL;
+
+    bucket->object_count = 0;
+    *bucket_balance(bucket) = 0;
+    bucket->bytes_free = page_size - bucket_header_size_get();
+    bucket->cache = cache;
+    #ifdef KISSMALLOC_SIZE_CLASSES
+    bucket->object_size = 0;
+    #endif
+    #ifdef KISSMALLOC_DIRTY_PAGES
+    memset(bucket->object_map, 0, bucket_object_map_size_get());
+    #endif
+    #ifdef KISSMALLOC_REUSE
+    bucket_reuse(bucket)->free_list = NULL;
+    bucket_reuse(bucket)->free_count = 0;
+    #endif
+
+    return bucket;
+}
+
+inline static void bucket_retire(struct bucket_t *bucket, const size_t page_size)
+{
+    if (__atomic_add_fetch(bucket_balance(bucket), (int32_t)bucket->object_count, __ATOMIC_ACQ_REL) == 0) {
+        struct cache_t *cache = bucket->cache;
+        cache_push(cache, bucket, page_size);
+        usage_add_onnode(-page_size, cache_node_get(cache));
+    }
+}
+
+#ifdef KISSMALLOC_REUSE
+
+static void cache_partial_insert(struct cache_t *cache, const int class_index, struct bucket_t *bucket)
+{
+    struct bucket_reuse_t *reuse = bucket_reuse(bucket);
+    struct bucket_t *head = cache->class_partial[class_index];
+    reuse->partial_prev = NULL;
+    reuse->partial_next = head;
+    if (head) bucket_reuse(head)->partial_prev = bucket;
+    cache->class_partial[class_index] = bucket;
+}
+
+static void cache_partial_remove(struct cache_t *cache, const int class_index, struct bucket_t *bucket)
+{
+    struct bucket_reuse_t *reuse = bucket_reuse(bucket);
+    if (reuse->partial_prev) bucket_reuse(reuse->partial_prev)->partial_next = reuse->partial_next;
+    else cache->class_partial[class_index] = reuse->partial_next;
+    if (reuse->partial_next) bucket_reuse(reuse->partial_next)->partial_prev = reuse->partial_prev;
+}
+
+/** Give up the freed objects kept for reuse by a zone, whose thread exits
+  * (the current class pages are retired afterwards, the retired pages are released if nothing else remains on them)
+  */
+static void cache_reuse_drop(struct cache_t *cache, const size_t page_size)
+{
+    for (int i = 0; i < KISSMALLOC_SIZE_CLASS_COUNT; ++i) {
+        struct bucket_t *bucket = cache->class_bucket[i];
+        if (bucket) {
+            struct bucket_reuse_t *reuse = bucket_reuse(bucket);
+            bucket->object_count -= reuse->free_count;
+            reuse->free_list = NULL;
+            reuse->free_count = 0;
+        }
+        for (bucket = cache->class_partial[i]; bucket != NULL;) {
+            struct bucket_reuse_t *reuse = bucket_reuse(bucket);
+            struct bucket_t *next = reuse->partial_next;
+            const uint32_t free_count = reuse->free_count;
+            bucket->object_count -= free_count;
+            reuse->free_list = NULL;
+            reuse->free_count = 0;
+            if (__atomic_sub_fetch(bucket_balance(bucket), (int32_t)free_count, __ATOMIC_ACQ_REL) == 0) {
+                cache_push(cache, bucket, page_size);
+                usage_add_onnode(-page_size, cache_node_get(cache));
+            }
+            bucket = next;
+        }
+        cache->class_partial[i] = NULL;
+    }
+}
+
+#endif // KISSMALLOC_REUSE
+
+static void bucket_cleanup(void *arg)
+{
+    #ifdef KISSMALLOC_TLS
+    struct bucket_t *bucket = bucket_current;
+    bucket_current = NULL;
+    #else
+    struct bucket_t *bucket = (struct bucket_t *)arg;
+    #endif
+
+    if (bucket) {
+        const size_t page_size = page_size_get();
+
+        struct cache_t *cache = bucket->cache;
+
+        #ifdef KISSMALLOC_REUSE
+        cache_reuse_drop(cache, page_size);
+        #endif
+
+        #ifdef KISSMALLOC_SIZE_CLASSES
+        for (int i = 0; i < KISSMALLOC_SIZE_CLASS_COUNT; ++i) {
+            if (cache->class_bucket[i]) bucket_retire(cache->class_bucket[i], page_size);
+        }
+        #endif
+
+        bucket_retire(bucket, page_size);
+
+        #ifndef KISSMALLOC_ZONE_DEPOT
+        cache_lock(cache);
+        #if KISSMALLOC_LARGE_CACHE > 0
+        large_cache_decay(&cache->large, 0);
+        #endif
+        cache_prealloc_release(cache, page_size);
+        cache_unlock(cache);
+        #endif
+
+        cache_cleanup(cache);
+
+        usage_flush();
+    }
+}
+
+#ifdef KISSMALLOC_DECAY
+
+/** Hand back the cached pages, the preallocated pages and the cached large mappings of all zones, which have not done
+  * any page operation since the last pass (zones in the middle of a page operation are skipped)
+  */
+static void decay_pass(const size_t page_size)
+{
+    while (__sync_lock_test_and_set(&cache_registry_lock, 1)) sched_yield();
+
+    for (struct cache_t *cache = cache_registry; cache != NULL; cache = cache->registry_next) {
+        if (__sync_lock_test_and_set(&cache->lock, 1)) continue;
+        if (cache->tick != cache->decay_tick) {
+            cache->decay_tick = cache->tick;
+        }
+        else {
+            cache_trim(cache, 0, page_size);
+        }
+        __sync_lock_release(&cache->lock);
+    }
+
+    __sync_lock_release(&cache_registry_lock);
+}
+
+static void *decay_run(void *arg)
+{
+    (void)arg;
+
+    const size_t page_size = page_size_get();
+
+    for (;;) {
+        struct timespec delay = { KISSMALLOC_DECAY_TIME / 1000, (long)(KISSMALLOC_DECAY_TIME % 1000) * 1000000 };
+        nanosleep(&delay, NULL);
+        decay_pass(page_size);
+    }
+
+    return NULL;
+}
+
+static char decay_started = 0; // reset in the child of fork(2), which only inherits the calling thread
+
+/** Start the background thread, unless it is running already (to be called without holding any lock of the allocator,
+  * because pthread_create(3) may allocate memory)
+  */
+static void decay_start()
+{
+    if (__atomic_load_n(&decay_started, __ATOMIC_RELAXED) || __sync_lock_test_and_set(&decay_started, 1)) return;
+
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr) != 0) return;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    pthread_create(&thread, &attr, decay_run, NULL); // zones just keep their pages if the thread can not be started
+    pthread_attr_destroy(&attr);
+}
+
+#endif // KISSMALLOC_DECAY
+
+#if defined(KISSMALLOC_PER_CPU) || defined(KISSMALLOC_DECAY)
+
+#ifdef KISSMALLOC_PER_CPU
+static int fork_zone_count = 0; // number of per-CPU zones locked by fork_prepare()
+#endif
+
+/** Take the locks of all zones before fork(2), so that the child does not inherit a zone held by another thread
+  * (in the lock order stated at cache_lock())
+  */
+static void fork_prepare()
+{
+    #ifdef KISSMALLOC_PER_CPU
+    struct cpu_zone_t *zone = __atomic_load_n(&cpu_zone, __ATOMIC_ACQUIRE);
+    fork_zone_count = (zone != NULL) ? cpu_zone_count : 0;
+    for (int i = 0; i < fork_zone_count; ++i) {
+        while (!__sync_bool_compare_and_swap(&zone[i].lock, 0, 1)) sched_yield();
+    }
+    #endif
+
+    #ifdef KISSMALLOC_DECAY
+    while (__sync_lock_test_and_set(&cache_registry_lock, 1)) sched_yield();
+    for (struct cache_t *cache = cache_registry; cache != NULL; cache = cache->registry_next) {
+        while (__sync_lock_test_and_set(&cache->lock, 1)) sched_yield();
+    }
+    #endif
+}
+
+/** Release the locks taken by fork_prepare(), in the parent as well as in the child
+  */
+static void fork_release()
+{
+    #ifdef KISSMALLOC_DECAY
+    for (struct cache_t *cache = cache_registry; cache != NULL; cache = cache->registry_next)
+        __sync_lock_release(&cache->lock);
+    __sync_lock_release(&cache_registry_lock);
+    #endif
+
+    #ifdef KISSMALLOC_PER_CPU
+    for (int i = 0; i < fork_zone_count; ++i) __sync_lock_release(&cpu_zone[i].lock);
+    #endif
+}
+
+static void fork_child()
+{
+    fork_release();
+
+    #ifdef KISSMALLOC_DECAY
+    decay_started = 0; // the next zone created restarts the background thread
+    #endif
+}
+
+static void __attribute__((constructor)) fork_init()
+{
+    pthread_atfork(fork_prepare, fork_release, fork_child);
+}
+
+#endif // defined(KISSMALLOC_PER_CPU) || defined(KISSMALLOC_DECAY)
+
+static void library_init()
+{
+    if (pthread_key_create(&bucket_key, bucket_cleanup) != 0) abort();
+    if (pthread_key_create(&source_key, NULL) != 0) abort();
+
+    #ifdef KISSMALLOC_PER_CPU
+    const long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+    const size_t size = round_up_pow2((cpu_count > 0 ? cpu_count : 1) * sizeof(struct cpu_zone_t), page_size_get());
+    struct cpu_zone_t *zone = (struct cpu_zone_t *)sys_mmap(size);
+    if (zone == MAP_FAILED) abort();
+    map_count_add(1);
+    cpu_zone_count = size / sizeof(struct cpu_zone_t);
+    cpu_zone_used = cpu_zone_count;
+    __atomic_store_n(&cpu_zone, zone, __ATOMIC_RELEASE);
+    #endif
+}
+
+#ifndef KISSMALLOC_PER_CPU
+
+static struct bucket_t *bucket_create_initial(const size_t page_size)
+{
+    pthread_once(&library_init_control, library_init);
+
+    struct bucket_t *bucket = bucket_create(cache_create(), page_size);
+    if (bucket == NULL) abort();
+
+    bucket_current_set(bucket);
+
+    #ifdef KISSMALLOC_DECAY
+    decay_start();
+    #endif
+
+    return bucket;
+}
+
+#endif
+
+static void *bucket_advance(struct bucket_t *bucket, const size_t page_size, const size_t item_size)
+{
+    struct bucket_t *bucket_new = bucket_create(bucket->cache, page_size);
+    if (bucket_new == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    bucket_retire(bucket, page_size);
+
+    bucket_mark(bucket_new, page_size - bucket_new->bytes_free);
+    bucket_new->bytes_free -= item_size;
+    bucket_new->object_count = 1;
+
+    bucket_current_set(bucket_new);
+
+    return (uint8_t *)bucket_new + bucket_header_size_get();
+}
+
+#ifdef KISSMALLOC_SIZE_CLASSES
+
+static void *class_advance(struct cache_t *cache, const int class_index, const size_t page_size, const size_t item_size)
+{
+    #ifdef KISSMALLOC_REUSE
+    struct bucket_t *bucket_partial = cache->class_partial[class_index];
+    if (bucket_partial != NULL) {
+        cache_partial_remove(cache, class_index, bucket_partial);
+        __atomic_sub_fetch(bucket_balance(bucket_partial), (int32_t)bucket_partial->object_count, __ATOMIC_ACQ_REL); // undo the retirement
+        struct bucket_t *bucket = cache->class_bucket[class_index];
+        if (bucket) bucket_retire(bucket, page_size);
+        cache->class_bucket[class_index] = bucket_partial;
+        return bucket_reuse_pop(bucket_partial);
+    }
+    #endif
+
+    struct bucket_t *bucket_new = bucket_create(cache, page_size);
+    if (bucket_new == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct bucket_t *bucket = cache->class_bucket[class_index];
+    if (bucket) bucket_retire(bucket, page_size);
+
+    bucket_new->bytes_free -= item_size;
+    bucket_new->object_count = 1;
+    bucket_new->object_size = item_size;
+
+    cache->class_bucket[class_index] = bucket_new;
+
+    return (uint8_t *)bucket_new + bucket_header_size_get();
+}
+
+#endif // KISSMALLOC_SIZE_CLASSES
+
+/** Current bucket of the calling thread, which needs to be handed back by bucket_put_mine() after use
+  */
+inline static struct bucket_t *bucket_get_mine(const size_t page_size)
+{
+    #ifdef KISSMALLOC_PER_CPU
+    if (KISSMALLOC_UNLIKELY(__atomic_load_n(&cpu_zone, __ATOMIC_ACQUIRE) == NULL)) pthread_once(&library_init_control, library_init);
+
+    struct cpu_zone_t *zone = &cpu_zone[cpu_id_get() % __atomic_load_n(&cpu_zone_used, __ATOMIC_RELAXED)];
+    while (!__sync_bool_compare_and_swap(&zone->lock, 0, 1)) sched_yield();
+
+    if (KISSMALLOC_UNLIKELY(zone->bucket == NULL)) {
+        struct cache_t *cache = cache_create();
+        cache->cpu_zone = zone;
+        zone->bucket = bucket_create(cache, page_size);
+        if (zone->bucket == NULL) abort();
+        #ifdef KISSMALLOC_DECAY
+        if (!__atomic_load_n(&decay_started, __ATOMIC_RELAXED)) {
+            __sync_lock_release(&zone->lock);
+            decay_start();
+            while (!__sync_bool_compare_and_swap(&zone->lock, 0, 1)) sched_yield();
+        }
+        #endif
+    }
+
+    return zone->bucket;
+    #else
+    struct bucket_t *bucket = bucket_current_get();
+    if (bucket == NULL) bucket = bucket_create_initial(page_size);
+    return bucket;
+    #endif
+}
+
+/** Hand back the current bucket taken by bucket_get_mine(), given the cache of any of its buckets
+  */
+inline static void bucket_put_mine(struct cache_t *cache)
+{
+    #ifdef KISSMALLOC_PER_CPU
+    __sync_lock_release(&cache->cpu_zone->lock);
+    #else
+    (void)cache;
+    #endif
+}
+
+/** Current bucket of the calling thread, if it is bucket, otherwise NULL; the top object of the current bucket may be
+  * resized or taken back until the bucket is handed back by bucket_put_mine() (in per-CPU mode the zone stays locked)
+  */
+inline static struct bucket_t *bucket_get_mine_if(struct bucket_t *bucket, const size_t page_size)
+{
+    #ifdef KISSMALLOC_PER_CPU
+    struct bucket_t *mine = bucket_get_mine(page_size);
+    if (mine == bucket) return bucket;
+    bucket_put_mine(mine->cache);
+    return NULL;
+    #else
+    (void)page_size;
+    return (bucket == bucket_current_get()) ? bucket : NULL;
+    #endif
+}
+
+/** Append text to a line buffer, without touching the heap
+  */
+static char *trace_text(const char *text, char *eoi)
+{
+    while (*text) {
+        *eoi = *text;
+        ++eoi;
+        ++text;
+    }
+    return eoi;
+}
+
+/** Append the decimal digits of value to a line buffer
+  */
+static char *trace_value(uint64_t value, char *eoi)
+{
+    char buf[256];
+    int fill = 0;
+    while (value > 0) {
+        buf[fill] = '0' + (char)(value % 10);
+        value /= 10;
+        ++fill;
+    }
+    if (fill == 0) {
+        buf[0] = '0';
+        fill = 1;
+    }
+    for (int i = fill - 1; i >= 0; --i) {
+        *eoi = buf[i];
+        ++eoi;
+    }
+    return eoi;
+}
+
+#ifdef KISSMALLOC_HISTOGRAM
+
+#include <sched.h>
+
+static uint64_t *histogram = (uint64_t *)NULL;
+static char histogram_lock = 0;
+
+static void histogram_write_line(const char *text)
+{
+    char buffer[256];
+    char *cursor = buffer;
+    cursor = trace_text(text, cursor);
+    cursor = trace_text("\n", cursor);
+    write(1, buffer, cursor - buffer);
+}
+
+inline static size_t histogram_size_get()
+{
+    return round_up_pow2(KISSMALLOC_HISTOGRAM_SIZE * sizeof(uint64_t), page_size_get());
+}
+
+static void histogram_cleanup()
+{
+    histogram_write_line("# size\tcount");
+
+    char line[256];
+
+    for (int i = 0; i < KISSMALLOC_HISTOGRAM_SIZE; ++i) {
+        char *cursor = line;
+        cursor = trace_value(i * KISSMALLOC_GRANULARITY, cursor);
+        cursor = trace_text("\t", cursor);
+        cursor = trace_value(histogram[i], cursor);
+        cursor = trace_text("\n", cursor);
+        write(1, line, cursor - line);
+    }
+
+    if (munmap((void *)histogram, histogram_size_get()) == -1) abort();
+}
+
+static uint64_t *histogram_allocate()
+{
+    void *page_start = mmap(NULL, histogram_size_get(), PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    if (page_start == MAP_FAILED) abort();
+
+    atexit(histogram_cleanup);
+
+    return (uint64_t *)page_start;
+}
+
+static uint64_t *histogram_get()
+{
+    if (!histogram) {
+        while (!__sync_bool_compare_and_swap(&histogram_lock, 0, 1)) sched_yield();
+        if (!histogram) histogram = histogram_allocate();
+        histogram_lock = 0;
+    }
+    return histogram;
+}
+
+inline static void histogram_sample(size_t item_size)
+{
+    const size_t item_size_rounded = round_up_pow2(item_size, KISSMALLOC_GRANULARITY);
+    int class_index = item_size_rounded >> KISSMALLOC_GRANULARITY_SHIFT;
+    if (class_index < KISSMALLOC_HISTOGRAM_SIZE) __sync_add_and_fetch(&histogram_get()[class_index], 1);
+}
+
+#endif // KISSMALLOC_HISTOGRAM
+
+/** Resize the object at offset in place to at most max_size and at least min_size bytes, if it is the top object of the bucket
+  * (the bucket must have been taken by bucket_get_mine_if()); returns the new object size or 0 on failure
+  */
+static size_t bucket_top_resize(struct bucket_t *bucket, const size_t offset, const size_t min_size, const size_t max_size, const size_t page_size)
+{
+    const size_t top = page_size - bucket->bytes_free;
+    if (bucket_object_end(bucket, offset, top) != top) return 0;
+
+    size_t size = round_up_pow2(max_size, KISSMALLOC_GRANULARITY);
+    if (size > page_size - offset) size = page_size - offset;
+    if (size < min_size || size == 0) return 0;
+
+    const size_t end = offset + size;
+    #ifndef KISSMALLOC_DIRTY_PAGES
+    if (end < top) memset((uint8_t *)bucket + end, 0, top - end); // keep the free space clean for calloc()
+    #endif
+    __atomic_store_n(&bucket->bytes_free, page_size - end, __ATOMIC_RELEASE); // malloc_usable_size() may read the top from other threads
+
+    return size;
+}
+
+#ifdef KISSMALLOC_REWIND
+
+/** Take back the object at offset, if it is the top object of bucket (the bucket must have been taken by bucket_get_mine_if())
+  */
+static int bucket_rewind(struct bucket_t *bucket, const size_t offset, const size_t page_size)
+{
+    const size_t i = offset >> KISSMALLOC_GRANULARITY_SHIFT;
+    if ((bucket->object_map[i >> 5] & ((uint32_t)1 << (i & 31))) == 0) return 0; // not the start of an object (e.g. aligned block)
+
+    const size_t top = page_size - bucket->bytes_free;
+    if (bucket_object_end(bucket, offset, top) != top) return 0;
+
+    #ifndef KISSMALLOC_DIRTY_PAGES
+    memset((uint8_t *)bucket + offset, 0, top - offset); // keep the free space clean for calloc()
+    #endif
+    __atomic_store_n(&bucket->bytes_free, page_size - offset, __ATOMIC_RELEASE);
+    bucket->object_map[i >> 5] &= ~((uint32_t)1 << (i & 31));
+    --bucket->object_count;
+
+    return 1;
+}
+
+#endif // KISSMALLOC_REWIND
+
+#ifdef KISSMALLOC_SCOPES
+
+/** Region of a scope, which consists of runs of pages, the first page of each run links to the next run
+  * and the first page of the first run also holds the scope itself
+  */
+struct scope_run_t {
+    struct scope_run_t *next;
+};
+
+struct scope_t {
+    struct scope_run_t run; // first run
+    struct scope_t *parent; // enclosing scope
+    struct bucket_t *bucket; // page currently allocated from
+    uint8_t *page_next; // next unused page of the current run
+    uint8_t *page_end; // end of the current run
+};
+
+#ifdef KISSMALLOC_TLS
+static __thread struct scope_t *scope_current __attribute__((tls_model("initial-exec"))) = NULL;
+#else
+static __thread struct scope_t *scope_current = NULL; // the default TLS model keeps the library loadable by dlopen(3)
+#endif
+
+static struct scope_run_t *scope_run_map(const size_t page_size)
+{
+    struct scope_run_t *run = (struct scope_run_t *)large_map(run_size_get(page_size), page_size);
+    if (run == NULL) return NULL;
+    usage_add(run_size_get(page_size));
+    return run;
+}
+
+static void scope_run_unmap(struct scope_run_t *run, const size_t page_size)
+{
+    if (sys_munmap(run, run_size_get(page_size)) == -1) abort();
+    map_count_add(-1);
+    usage_add(-run_size_get(page_size));
+}
+
+/** Pages of a scope are never retired, so their balance counter never returns to zero and free() leaves them alone
+  * (the zone of a scope page is NULL, which tells the pages of scopes apart from regular pages)
+  */
+static struct bucket_t *scope_bucket_create(struct scope_t *scope, const size_t page_size)
+{
+    if (scope->page_next == scope->page_end) {
+        struct scope_run_t *run = scope_run_map(page_size);
+        if (run == NULL) return NULL;
+        run->next = scope->run.next;
+        scope->run.next = run;
+        scope->page_next = (uint8_t *)run + page_size;
+        scope->page_end = (uint8_t *)run + run_size_get(page_size);
+    }
+
+    struct bucket_t *bucket = (struct bucket_t *)scope->page_next;
+    scope->page_next += page_size;
+
+    bucket->object_count = 0;
+    *bucket_balance(bucket) = 0;
+    bucket->bytes_free = page_size - bucket_header_size_get();
+    bucket->cache = NULL;
+    #ifdef KISSMALLOC_SIZE_CLASSES
+    bucket->object_size = 0;
+    #endif
+
+    return bucket;
+}
+
+static void *scope_malloc(struct scope_t *scope, size_t size, const size_t page_size)
+{
+    size = round_up_pow2(size, KISSMALLOC_GRANULARITY);
+
+    struct bucket_t *bucket = scope->bucket;
+
+    if (KISSMALLOC_UNLIKELY(size > bucket->bytes_free)) {
+        bucket = scope_bucket_create(scope, page_size);
+        if (bucket == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        scope->bucket = bucket;
+    }
+
+    return bucket_carve(bucket, page_size, size);
+}
+
+inline static int scope_owns(const void *ptr, const size_t page_size)
+{
+    const size_t page_offset = (size_t)((const uint8_t *)ptr - (const uint8_t *)NULL) & (page_size - 1);
+    return page_offset != 0 && ((const struct bucket_t *)((const uint8_t *)ptr - page_offset))->cache == NULL;
+}
+
+#endif // KISSMALLOC_SCOPES
+
+/** Number of usable bytes of the block at ptr
+  */
+static size_t block_size_get(const void *ptr, const size_t page_size)
+{
+    const size_t page_offset = (size_t)((const uint8_t *)ptr - (const uint8_t *)NULL) & (page_size - 1);
+
+    if (page_offset == 0) return *(const size_t *)((const uint8_t *)ptr - page_size) - page_size;
+
+    const struct bucket_t *bucket = (const struct bucket_t *)((const uint8_t *)ptr - page_offset);
+
+    #ifdef KISSMALLOC_SIZE_CLASSES
+    if (bucket->object_size > 0) {
+        const size_t object_size = bucket->object_size;
+        return object_size - (page_offset - bucket_header_size_get()) % object_size;
+    }
+    #endif
+
+    const size_t top = page_size - __atomic_load_n(&bucket->bytes_free, __ATOMIC_ACQUIRE);
+    return bucket_object_end(bucket, page_offset, top) - page_offset;
+}
+
+static void *large_alloc(size_t size, const size_t page_size, const int clear)
+{
+    size = round_up_pow2(size, page_size) + page_size;
+
+    #if KISSMALLOC_LARGE_CACHE > 0
+    if (size <= KISSMALLOC_LARGE_CACHE) {
+        struct cache_t *cache = bucket_get_mine(page_size)->cache;
+        cache_lock(cache);
+        uint8_t *head = large_cache_get(&cache->large, size);
+        cache_unlock(cache);
+        bucket_put_mine(cache);
+        if (head != NULL) {
+            if (clear) memset(head + page_size, 0, size - page_size);
+            usage_add_onnode(*(size_t *)head, large_node_get(head));
+            large_stats_add(1, *(size_t *)head);
+            return head + page_size;
+        }
+    }
+    #endif
+
+    void *head = large_map(size, page_size);
+    if (KISSMALLOC_UNLIKELY(head == NULL)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    *(size_t *)head = size;
+
+    #ifdef KISSMALLOC_NUMA
+    struct cache_t *cache = bucket_get_mine(page_size)->cache;
+    const int node = cache_node_get(cache);
+    bucket_put_mine(cache);
+    numa_bind(head, size, node);
+    large_node_set(head, node);
+    #endif
+
+    usage_add_onnode(size, large_node_get(head));
+    large_stats_add(1, size);
+
+    return (uint8_t *)head + page_size;
+}
+
+#if KISSMALLOC_MREMAP && defined(MREMAP_MAYMOVE)
+
+static void *large_realloc(void *ptr, size_t size, const size_t page_size)
+{
+    uint8_t *head = (uint8_t *)ptr - page_size;
+    const size_t old_size = *(size_t *)head;
+
+    size = round_up_pow2(size, page_size) + page_size;
+    if (size == old_size) return ptr;
+
+    void *new_head = sys_mremap(head, old_size, size, MREMAP_MAYMOVE);
+    if (new_head == MAP_FAILED) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    *(size_t *)new_head = size;
+
+    usage_add_onnode(size - old_size, large_node_get(new_head));
+    large_stats_add(0, size - old_size);
+
+    return (uint8_t *)new_head + page_size;
+}
+
+#endif
+
+void *KISSMALLOC_NAME(malloc)(size_t size)
+{
+    #ifdef KISSMALLOC_HISTOGRAM
+    histogram_sample(size);
+    #endif
+
+    const size_t page_size = page_size_get();
+
+    #ifdef KISSMALLOC_SCOPES
+    if (KISSMALLOC_UNLIKELY(scope_current != NULL) && size - 1 < page_size - bucket_header_size_get())
+        return scope_malloc(scope_current, size, page_size);
+    #endif
+
+    #ifdef KISSMALLOC_SIZE_CLASSES
+    if (KISSMALLOC_LIKELY(size <= KISSMALLOC_SIZE_CLASS_MAX))
+    {
+        if (KISSMALLOC_UNLIKELY(size == 0)) return NULL;
+
+        const int class_index = size_class_index(size);
+        size = size_class_size(class_index);
+
+        struct cache_t *cache = bucket_get_mine(page_size)->cache;
+        struct bucket_t *bucket = cache->class_bucket[class_index];
+
+        void *data = NULL;
+
+        #ifdef KISSMALLOC_REUSE
+        if (bucket != NULL && bucket_reuse(bucket)->free_list != NULL)
+            data = bucket_reuse_pop(bucket);
+        else
+        #endif
+        if (KISSMALLOC_LIKELY(bucket != NULL && size <= bucket->bytes_free)) {
+            data = (uint8_t *)bucket + page_size - bucket->bytes_free;
+            bucket->bytes_free -= size;
+            ++bucket->object_count;
+        }
+        else
+            data = class_advance(cache, class_index, page_size, size);
+
+        bucket_put_mine(cache);
+        return data;
+    }
+    #endif
+
+    if (KISSMALLOC_LIKELY(size < page_size >> 1))
+    {
+        if (KISSMALLOC_UNLIKELY(size == 0)) return NULL;
+
+        size = round_up_pow2(size, KISSMALLOC_GRANULARITY);
+
+        struct bucket_t *bucket = bucket_get_mine(page_size);
+
+        void *data = KISSMALLOC_LIKELY(size <= bucket->bytes_free) ? bucket_carve(bucket, page_size, size) : bucket_advance(bucket, page_size, size);
+
+        bucket_put_mine(bucket->cache);
+        return data;
+    }
+    else if (size <= page_size - bucket_header_size_get())
+    {
+        size = round_up_pow2(size, KISSMALLOC_GRANULARITY);
+
+        struct bucket_t *bucket = bucket_get_mine(page_size);
+
+        void *data = (size <= bucket->bytes_free) ? bucket_carve(bucket, page_size, size) : bucket_advance(bucket, page_size, size);
+
+        bucket_put_mine(bucket->cache);
+        return data;
+    }
+
+    return large_alloc(size, page_size, 0);
+}
+
+#ifdef KISSMALLOC_REUSE
+
+/** Keep the object at ptr of a size-class page for reuse, if the page belongs to the zone of the calling thread
+  * (returns 0 if the object needs to be freed the regular way)
+  */
+static int bucket_reuse_push(struct bucket_t *bucket, void *ptr, const size_t page_size)
+{
+    struct cache_t *cache = bucket_get_mine(page_size)->cache;
+    const int mine = (bucket->cache == cache);
+
+    if (mine) {
+        /// aligned blocks may start inside their slot, so step back to the start of the slot
+        const size_t page_offset = (uint8_t *)ptr - (uint8_t *)bucket;
+        ptr = (uint8_t *)ptr - (page_offset - bucket_header_size_get()) % bucket->object_size;
+
+        struct bucket_reuse_t *reuse = bucket_reuse(bucket);
+        *(void **)ptr = reuse->free_list;
+        reuse->free_list = ptr;
+        ++reuse->free_count;
+
+        const int class_index = size_class_index(bucket->object_size);
+        if (cache->class_bucket[class_index] != bucket) {
+            if (reuse->free_count == 1) cache_partial_insert(cache, class_index, bucket);
+
+            /// the page is retired, so its balance equals the number of objects on the free list once all others have been freed
+            int32_t balance = (int32_t)reuse->free_count;
+            if (
+                __atomic_load_n(bucket_balance(bucket), __ATOMIC_RELAXED) == balance &&
+                __atomic_compare_exchange_n(bucket_balance(bucket), &balance, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+            ) {
+                cache_partial_remove(cache, class_index, bucket);
+                cache_push(cache, bucket, page_size);
+                usage_add_onnode(-page_size, cache_node_get(cache));
+            }
+        }
+    }
+
+    bucket_put_mine(cache);
+    return mine;
+}
+
+#endif // KISSMALLOC_REUSE
+
+/** Hand back a page, whose objects have all been freed
+  */
+static void bucket_release(struct bucket_t *bucket, const size_t page_size)
+{
+    const int node = cache_node_get(bucket->cache);
+
+    struct cache_t *cache = bucket_get_mine(page_size)->cache;
+    #ifdef KISSMALLOC_REMOTE_FREE
+    if (bucket->cache != cache) cache_remote_push(bucket->cache, bucket);
+    else
+    #endif
+    cache_push(cache, bucket, page_size);
+    bucket_put_mine(cache);
+
+    usage_add_onnode(-page_size, node);
+}
 
-    pthread_setspecific(bucket_key, bucket);
+void KISSMALLOC_NAME(free)(void *ptr)
+{
+    if (ptr == NULL) return;
 
-    usage_add(page_size);
+    const size_t page_size = page_size_get();
+    const size_t page_offset = (size_t)(((uint8_t *)ptr - (uint8_t *)NULL) & (page_size - 1));
 
-    return (uint8_t *)page_start + bucket_header_size;
+    if (KISSMALLOC_LIKELY(page_offset != 0)) {
+        void *page_start = (uint8_t *)ptr - page_offset;
+        struct bucket_t *bucket = (struct bucket_t *)page_start;
+        #ifdef KISSMALLOC_REWIND
+        if (bucket_get_mine_if(bucket, page_size) != NULL) {
+            const int rewound = bucket_rewind(bucket, page_offset, page_size);
+            bucket_put_mine(bucket->cache);
+            if (rewound) return;
+        }
+        #endif
+        #ifdef KISSMALLOC_REUSE
+        if (bucket->object_size > 0 && bucket_reuse_push(bucket, ptr, page_size)) return;
+        #endif
+        if (KISSMALLOC_UNLIKELY(__atomic_sub_fetch(bucket_balance(bucket), 1, __ATOMIC_ACQ_REL) == 0))
+            bucket_release(bucket, page_size);
+    }
+    else if (ptr != NULL) {
+        void *head = (uint8_t *)ptr - page_size;
+        size_t size = *(size_t *)head;
+        usage_add_onnode(-size, large_node_get(head));
+        large_stats_add(-1, -size);
+        #if KISSMALLOC_LARGE_CACHE > 0
+        struct cache_t *cache = bucket_get_mine(page_size)->cache;
+        cache_lock(cache);
+        const int cached = large_cache_put(&cache->large, (uint8_t *)head, size);
+        cache_unlock(cache);
+        bucket_put_mine(cache);
+        if (cached) return;
+        #endif
+        if (sys_munmap(head, size) == -1) abort();
+        map_count_add(-1);
+    }
 }
 
-inline static struct bucket_t *bucket_get_mine(const size_t page_size)
+/** Free the block at ptr, which has been allocated by malloc(), calloc() or realloc() with the given size
+  * (or whose size has been reported by malloc_usable_size() or kissexpand()); saves reading the header page of large blocks
+  */
+void KISSMALLOC_NAME(free_sized)(void *ptr, size_t size)
 {
-    struct bucket_t *bucket = (struct bucket_t *)pthread_getspecific(bucket_key);
-    if (bucket == NULL) bucket = bucket_create_initial(page_size);
-    return bucket;
+    #if KISSMALLOC_LARGE_CACHE == 0 && !defined(KISSMALLOC_NUMA)
+    const size_t page_size = page_size_get();
+    if (ptr != NULL && ((size_t)((uint8_t *)ptr - (uint8_t *)NULL) & (page_size - 1)) == 0) {
+        size = round_up_pow2(size, page_size) + page_size;
+        usage_add(-size);
+        large_stats_add(-1, -size);
+        if (sys_munmap((uint8_t *)ptr - page_size, size) == -1) abort();
+        map_count_add(-1);
+        return;
+    }
+    #endif
+
+    KISSMALLOC_NAME(free)(ptr);
 }
 
-#ifdef KISSMALLOC_HISTOGRAM
+/** Free the block at ptr, which has been allocated by aligned_alloc() with the given alignment and size
+  */
+void KISSMALLOC_NAME(free_aligned_sized)(void *ptr, size_t alignment, size_t size)
+{
+    if (alignment <= KISSMALLOC_GRANULARITY) KISSMALLOC_NAME(free_sized)(ptr, size);
+    else KISSMALLOC_NAME(free)(ptr);
+}
 
-#include <sched.h>
+/** Allocate count objects of size bytes each and store them in ptrs (inside a scope the objects are taken from the scope)
+  * Returns the number of objects allocated, which is less than count if memory runs out.
+  */
+size_t kissmalloc_bulk(size_t size, size_t count, void **ptrs)
+{
+    const size_t page_size = page_size_get();
 
-static uint64_t *histogram = (uint64_t *)NULL;
-static char histogram_lock = 0;
+    if (
+        size == 0 ||
+        size > page_size - bucket_header_size_get()
+        #ifdef KISSMALLOC_SIZE_CLASSES
+        || size <= KISSMALLOC_SIZE_CLASS_MAX
+        #endif
+        #ifdef KISSMALLOC_SCOPES
+        || scope_current != NULL
+        #endif
+    ) {
+        size_t i = 0;
+        for (; i < count; ++i) {
+            ptrs[i] = KISSMALLOC_NAME(malloc)(size);
+            if (ptrs[i] == NULL && size > 0) break;
+        }
+        return i;
+    }
+
+    size = round_up_pow2(size, KISSMALLOC_GRANULARITY);
+
+    struct bucket_t *bucket = bucket_get_mine(page_size);
+
+    size_t i = 0;
+    while (i < count) {
+        size_t n = bucket->bytes_free / size;
+        if (n == 0) {
+            uint8_t *data = (uint8_t *)bucket_advance(bucket, page_size, size);
+            if (data == NULL) break;
+            ptrs[i++] = data;
+            bucket = (struct bucket_t *)(data - bucket_header_size_get());
+            continue;
+        }
+        if (n > count - i) n = count - i;
+
+        const size_t offset = page_size - bucket->bytes_free;
+        for (size_t k = 0; k < n; ++k) {
+            bucket_mark(bucket, offset + k * size);
+            ptrs[i + k] = (uint8_t *)bucket + offset + k * size;
+        }
+        __atomic_store_n(&bucket->bytes_free, bucket->bytes_free - n * size, __ATOMIC_RELEASE);
+        bucket->object_count += n;
+        i += n;
+    }
+
+    bucket_put_mine(bucket->cache);
 
-static char *histogram_trace_text(const char *text, char *eoi)
+    return i;
+}
+
+/** Free count objects stored in ptrs
+  * Consecutive objects on the same page are accounted for by a single atomic operation,
+  * so this works best if the objects are passed in the order they have been allocated.
+  */
+void kissfree_bulk(void **ptrs, size_t count)
 {
-    while (*text) {
-        *eoi = *text;
-        ++eoi;
-        ++text;
+    #ifdef KISSMALLOC_REUSE
+    for (size_t i = 0; i < count; ++i) KISSMALLOC_NAME(free)(ptrs[i]); // each object goes to the free list of its page
+    #else
+    const size_t page_size = page_size_get();
+
+    struct bucket_t *bucket = NULL;
+    int32_t n = 0;
+
+    for (size_t i = 0; i <= count; ++i) {
+        struct bucket_t *bucket_next = NULL;
+
+        if (i < count) {
+            void *ptr = ptrs[i];
+            if (ptr == NULL) continue;
+            const size_t page_offset = (size_t)((uint8_t *)ptr - (uint8_t *)NULL) & (page_size - 1);
+            if (page_offset == 0) {
+                KISSMALLOC_NAME(free)(ptr);
+                continue;
+            }
+            bucket_next = (struct bucket_t *)((uint8_t *)ptr - page_offset);
+            if (bucket_next == bucket) {
+                ++n;
+                continue;
+            }
+        }
+
+        if (n > 0 && __atomic_sub_fetch(bucket_balance(bucket), n, __ATOMIC_ACQ_REL) == 0)
+            bucket_release(bucket, page_size);
+
+        bucket = bucket_next;
+        n = 1;
     }
-    return eoi;
+    #endif
+}
+
+void *KISSMALLOC_NAME(calloc)(size_t number, size_t size)
+{
+    size_t total = 0;
+    if (__builtin_mul_overflow(number, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    #if KISSMALLOC_LARGE_CACHE > 0
+    const size_t page_size = page_size_get();
+    if (total > page_size - bucket_header_size_get()) return large_alloc(total, page_size, 1);
+    #endif
+
+    void *data = KISSMALLOC_NAME(malloc)(total);
+    __asm__("" : "+r" (data)); // keeps the compiler from merging malloc() and memset() into a call of calloc() itself
+
+    #ifdef KISSMALLOC_DIRTY_PAGES
+    if (data != NULL && total <= page_size_get() - bucket_header_size_get()) memset(data, 0, total);
+    #elif defined(KISSMALLOC_REUSE)
+    if (data != NULL && total <= KISSMALLOC_SIZE_CLASS_MAX) memset(data, 0, total); // may be a reused object
+    #endif
+
+    return data;
 }
 
-static char *histogram_trace_value(uint64_t value, char *eoi)
+void *KISSMALLOC_NAME(realloc)(void *ptr, size_t size)
 {
-    char buf[256];
-    int fill = 0;
-    while (value > 0) {
-        buf[fill] = '0' + (char)(value % 10);
-        value /= 10;
-        ++fill;
+    if (ptr == NULL) return KISSMALLOC_NAME(malloc)(size);
+
+    if (size == 0) {
+        if (ptr != NULL) KISSMALLOC_NAME(free)(ptr);
+        return NULL;
     }
-    if (fill == 0) {
-        buf[0] = '0';
-        fill = 1;
+
+    const size_t page_size = page_size_get();
+    size_t page_offset = (size_t)((uint8_t *)ptr - (uint8_t *)NULL) & (page_size - 1);
+
+    if (page_offset != 0 && size <= KISSMALLOC_GRANULARITY) return ptr;
+
+    if (page_offset == 0) {
+        #if KISSMALLOC_MREMAP && defined(MREMAP_MAYMOVE)
+        if (size > page_size - bucket_header_size_get()) return large_realloc(ptr, size, page_size);
+        #endif
     }
-    for (int i = fill - 1; i >= 0; --i) {
-        *eoi = buf[i];
-        ++eoi;
+    else {
+        struct bucket_t *bucket = (struct bucket_t *)((uint8_t *)ptr - page_offset);
+        if (
+            #ifdef KISSMALLOC_SIZE_CLASSES
+            bucket->object_size == 0 &&
+            #endif
+            bucket_get_mine_if(bucket, page_size) != NULL
+        ) {
+            const size_t resized = bucket_top_resize(bucket, page_offset, size, size, page_size);
+            bucket_put_mine(bucket->cache);
+            if (resized > 0) return ptr;
+        }
     }
-    return eoi;
+
+    size_t copy_size = block_size_get(ptr, page_size);
+    if (page_offset != 0 && size <= copy_size) return ptr; // the pages of small objects are released as a whole, anyway
+
+    if (copy_size > size) copy_size = size;
+
+    #ifdef KISSMALLOC_SCOPES
+    struct scope_t *scope = scope_current;
+    if (scope != NULL && !scope_owns(ptr, page_size)) scope_current = NULL; // do not move blocks from outside into the scope
+    void *new_ptr = KISSMALLOC_NAME(malloc)(size);
+    scope_current = scope;
+    #else
+    void *new_ptr = KISSMALLOC_NAME(malloc)(size);
+    #endif
+    if (new_ptr == NULL) return NULL;
+
+    memcpy(new_ptr, ptr, copy_size);
+
+    KISSMALLOC_NAME(free)(ptr);
+
+    return new_ptr;
+}
+
+int KISSMALLOC_NAME(posix_memalign)(void **ptr, size_t alignment, size_t size)
+{
+    if (size == 0) {
+        *ptr = NULL;
+        return 0;
+    }
+
+    if (
+        !KISSMALLOC_IS_POW2(alignment) ||
+        (alignment & (sizeof(void *) - 1)) != 0
+    )
+        return EINVAL;
+
+    if (alignment <= KISSMALLOC_GRANULARITY) {
+        *ptr = KISSMALLOC_NAME(malloc)(size);
+        return (*ptr != NULL) ? 0 : ENOMEM;
+    }
+
+    const size_t page_size = page_size_get();
+
+    if (alignment + size < page_size >> 1) {
+        uint8_t *ptr_byte = (uint8_t *)KISSMALLOC_NAME(malloc)(alignment + size);
+        if (ptr_byte != NULL) {
+            size_t r = (size_t)(ptr_byte - (uint8_t *)NULL) & (alignment - 1);
+            if (r > 0) ptr_byte += alignment - r;
+            *ptr = ptr_byte;
+            return 0;
+        }
+    }
+
+    size += alignment + page_size;
+
+    void *head = sys_mmap(size);
+    if (head == MAP_FAILED) return ENOMEM;
+    map_count_add(1);
+
+    while (
+        (
+            (((uint8_t *)head - (uint8_t *)NULL) + page_size)
+            & (alignment - 1)
+        ) != 0
+    ) {
+        if (sys_munmap(head, page_size) == -1) abort();
+        head = (uint8_t *)head + page_size;
+        size -= page_size;
+    }
+
+    *(size_t *)head = size;
+    #ifdef KISSMALLOC_NUMA
+    large_node_set(head, numa_node_get()); // not bound, but most likely placed by first touch of the calling thread
+    #endif
+    *ptr = (uint8_t *)head + page_size;
+
+    usage_add_onnode(size, large_node_get(head));
+    large_stats_add(1, size);
+
+    return 0;
+}
+
+void *KISSMALLOC_NAME(aligned_alloc)(size_t alignment, size_t size)
+{
+    void *ptr = NULL;
+    KISSMALLOC_NAME(posix_memalign)(&ptr, alignment, size);
+    return ptr;
+}
+
+void *KISSMALLOC_NAME(memalign)(size_t alignment, size_t size)
+{
+    void *ptr = NULL;
+    KISSMALLOC_NAME(posix_memalign)(&ptr, alignment, size);
+    return ptr;
+}
+
+void *KISSMALLOC_NAME(valloc)(size_t size)
+{
+    return KISSMALLOC_NAME(malloc)(round_up_pow2(size, page_size_get()));
+}
+
+void *KISSMALLOC_NAME(pvalloc)(size_t size)
+{
+    return KISSMALLOC_NAME(malloc)(round_up_pow2(size, page_size_get()));
+}
+
+/** Try to resize the block at ptr in place to hold max_size bytes, or at least min_size bytes, without moving it
+  * Returns the new usable size of the block, or 0 if the block could not be resized (in which case it is left unchanged).
+  */
+size_t kissexpand(void *ptr, size_t min_size, size_t max_size)
+{
+    if (ptr == NULL || min_size == 0) return 0;
+    if (max_size < min_size) max_size = min_size;
+
+    const size_t page_size = page_size_get();
+    const size_t page_offset = (size_t)((uint8_t *)ptr - (uint8_t *)NULL) & (page_size - 1);
+
+    if (page_offset == 0) {
+        uint8_t *head = (uint8_t *)ptr - page_size;
+        const size_t old_size = *(size_t *)head;
+        #if KISSMALLOC_MREMAP && defined(MREMAP_MAYMOVE)
+        for (size_t request = max_size; ; request = min_size) {
+            const size_t size = round_up_pow2(request, page_size) + page_size;
+            if (size == old_size) return size - page_size;
+            if (sys_mremap(head, old_size, size, 0) != MAP_FAILED) {
+                *(size_t *)head = size;
+                usage_add_onnode(size - old_size, large_node_get(head));
+                large_stats_add(0, size - old_size);
+                return size - page_size;
+            }
+            if (request == min_size) break;
+        }
+        #endif
+        return (old_size - page_size >= min_size) ? old_size - page_size : 0;
+    }
+
+    struct bucket_t *bucket = (struct bucket_t *)((uint8_t *)ptr - page_offset);
+
+    if (
+        #ifdef KISSMALLOC_SIZE_CLASSES
+        bucket->object_size == 0 &&
+        #endif
+        bucket_get_mine_if(bucket, page_size) != NULL
+    ) {
+        const size_t size = bucket_top_resize(bucket, page_offset, min_size, max_size, page_size);
+        bucket_put_mine(bucket->cache);
+        if (size > 0) return size;
+    }
+
+    const size_t size = block_size_get(ptr, page_size);
+    return (size >= min_size) ? size : 0;
+}
+
+/** Usable size of the block at ptr
+  */
+size_t KISSMALLOC_NAME(malloc_usable_size)(void *ptr)
+{
+    if (ptr == NULL) return 0;
+    return block_size_get(ptr, page_size_get());
+}
+
+/** Number of bytes malloc() would actually reserve for a request of size bytes
+  */
+size_t kissgoodsize(size_t size)
+{
+    if (size == 0) return 0;
+
+    const size_t page_size = page_size_get();
+
+    #ifdef KISSMALLOC_SIZE_CLASSES
+    if (size <= KISSMALLOC_SIZE_CLASS_MAX) return size_class_size(size_class_index(size));
+    #endif
+
+    if (size <= page_size - bucket_header_size_get()) return round_up_pow2(size, KISSMALLOC_GRANULARITY);
+
+    return round_up_pow2(size, page_size);
+}
+
+/** Allocate a block of size bytes, whose pages are placed on the given NUMA node (the block occupies whole pages,
+  * so this is meant for buffers of a page or more); the block is released by free()
+  */
+void *kissmalloc_onnode(size_t size, int node)
+{
+    if (size == 0) return NULL;
+
+    if (node < 0 || node >= numa_node_count_get()) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const size_t page_size = page_size_get();
+    size = round_up_pow2(size, page_size) + page_size;
+
+    void *head = large_map(size, page_size);
+    if (head == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    numa_bind(head, size, node);
+
+    *(size_t *)head = size;
+    large_node_set(head, node);
+
+    usage_add_onnode(size, node);
+    large_stats_add(1, size);
+
+    return (uint8_t *)head + page_size;
+}
+
+/** Number of NUMA nodes of the system (1 on systems without NUMA support)
+  */
+int kissmalloc_node_count()
+{
+    return numa_node_count_get();
+}
+
+/** Number of bytes allocated minus number of bytes freed on the given NUMA node
+  * (only tracked if KISSMALLOC_NUMA is defined, otherwise all memory is accounted to node 0)
+  */
+size_t kissmemusage_onnode(int node)
+{
+    if (node < 0 || node >= numa_node_count_get()) return 0;
+    #ifdef KISSMALLOC_NUMA
+    return __atomic_load_n(&numa_usage[node].bytes, __ATOMIC_RELAXED);
+    #else
+    return (node == 0) ? KISSMALLOC_NAME(memusage)() : 0;
+    #endif
 }
 
-static void histogram_write_line(const char *text)
+/** Memory chunk of an arena, the chunks of an arena are linked from the most recently mapped one to the first one,
+  * which also holds the arena itself
+  */
+struct arena_chunk_t {
+    struct arena_chunk_t *next;
+    size_t size;
+};
+
+struct kiss_arena_t {
+    struct arena_chunk_t chunk; // first chunk
+    struct arena_chunk_t *head; // chunk currently allocated from
+    uint8_t *top; // start of the free space in the current chunk
+    uint8_t *end; // end of the current chunk
+};
+
+inline static size_t arena_header_size_get()
 {
-    char buffer[256];
-    char *cursor = buffer;
-    cursor = histogram_trace_text(text, cursor);
-    cursor = histogram_trace_text("\n", cursor);
-    write(1, buffer, cursor - buffer);
+    return round_up_pow2(sizeof(struct kiss_arena_t), KISSMALLOC_GRANULARITY);
 }
 
-inline static size_t histogram_size_get()
+inline static size_t arena_chunk_header_size_get()
 {
-    return round_up_pow2(KISSMALLOC_HISTOGRAM_SIZE * sizeof(uint64_t), page_size_get());
+    return round_up_pow2(sizeof(struct arena_chunk_t), KISSMALLOC_GRANULARITY);
 }
 
-static void histogram_cleanup()
+static struct arena_chunk_t *arena_chunk_map(size_t size, const size_t page_size)
 {
-    histogram_write_line("# size\tcount");
+    struct arena_chunk_t *chunk = (struct arena_chunk_t *)large_map(size, page_size);
+    if (chunk == NULL) return NULL;
+    chunk->size = size;
+    usage_add(size);
+    return chunk;
+}
 
-    char line[256];
+static void arena_chunk_unmap(struct arena_chunk_t *chunk)
+{
+    const size_t size = chunk->size;
+    if (sys_munmap(chunk, size) == -1) abort();
+    map_count_add(-1);
+    usage_add(-size);
+}
 
-    for (int i = 0; i < KISSMALLOC_HISTOGRAM_SIZE; ++i) {
-        char *cursor = line;
-        cursor = histogram_trace_value(i * KISSMALLOC_GRANULARITY, cursor);
-        cursor = histogram_trace_text("\t", cursor);
-        cursor = histogram_trace_value(histogram[i], cursor);
-        cursor = histogram_trace_text("\n", cursor);
-        write(1, line, cursor - line);
+/** Unmap all chunks of arena except the first one
+  */
+static void arena_chunks_unmap(struct kiss_arena_t *arena)
+{
+    for (struct arena_chunk_t *chunk = arena->head; chunk != &arena->chunk;) {
+        struct arena_chunk_t *next = chunk->next;
+        arena_chunk_unmap(chunk);
+        chunk = next;
+    }
+    for (struct arena_chunk_t *chunk = arena->chunk.next; chunk != NULL;) {
+        struct arena_chunk_t *next = chunk->next;
+        arena_chunk_unmap(chunk);
+        chunk = next;
     }
-
-    if (munmap((void *)histogram, histogram_size_get()) == -1) abort();
 }
 
-static uint64_t *histogram_allocate()
+/** Create a new arena, which serves allocations by bumping a pointer through chunks of memory mapped on demand
+  * (an arena is not thread-safe, it is meant to be used by one thread at a time)
+  */
+struct kiss_arena_t *kiss_arena_create()
 {
-    void *page_start = mmap(NULL, histogram_size_get(), PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-    if (page_start == MAP_FAILED) abort();
+    const size_t page_size = page_size_get();
 
-    atexit(histogram_cleanup);
+    struct kiss_arena_t *arena = (struct kiss_arena_t *)arena_chunk_map(run_size_get(page_size), page_size);
+    if (arena == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    return (uint64_t *)page_start;
+    arena->chunk.next = NULL;
+    arena->head = &arena->chunk;
+    arena->top = (uint8_t *)arena + arena_header_size_get();
+    arena->end = (uint8_t *)arena + arena->chunk.size;
+
+    return arena;
 }
 
-static uint64_t *histogram_get()
+/** Continue in a new chunk, which is twice as large as the current one, or map a dedicated chunk for an
+  * oversized block, which leaves the current chunk in place
+  */
+static void *arena_advance(struct kiss_arena_t *arena, const size_t size)
 {
-    if (!histogram) {
-        while (!__sync_bool_compare_and_swap(&histogram_lock, 0, 1)) sched_yield();
-        if (!histogram) histogram = histogram_allocate();
-        histogram_lock = 0;
+    const size_t page_size = page_size_get();
+    const size_t chunk_size = 2 * arena->head->size;
+    const size_t needed_size = round_up_pow2(arena_chunk_header_size_get() + size, page_size);
+
+    if (needed_size > chunk_size) {
+        struct arena_chunk_t *chunk = arena_chunk_map(needed_size, page_size);
+        if (chunk == NULL) return NULL;
+        chunk->next = arena->head->next;
+        arena->head->next = chunk;
+        return (uint8_t *)chunk + arena_chunk_header_size_get();
     }
-    return histogram;
+
+    struct arena_chunk_t *chunk = arena_chunk_map(chunk_size, page_size);
+    if (chunk == NULL) return NULL;
+    chunk->next = arena->head;
+    arena->head = chunk;
+    arena->top = (uint8_t *)chunk + arena_chunk_header_size_get() + size;
+    arena->end = (uint8_t *)chunk + chunk_size;
+    return (uint8_t *)chunk + arena_chunk_header_size_get();
 }
 
-inline static void histogram_sample(size_t item_size)
+/** Allocate size bytes from arena; the block must not be passed to free() or realloc(), it lives until the arena
+  * is reset or destroyed
+  */
+void *kiss_arena_malloc(struct kiss_arena_t *arena, size_t size)
 {
-    const size_t item_size_rounded = round_up_pow2(item_size, KISSMALLOC_GRANULARITY);
-    int class_index = item_size_rounded >> KISSMALLOC_GRANULARITY_SHIFT;
-    if (class_index < KISSMALLOC_HISTOGRAM_SIZE) __sync_add_and_fetch(&histogram_get()[class_index], 1);
-}
+    if (size > SIZE_MAX / 4) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-#endif // KISSMALLOC_HISTOGRAM
+    size = (size == 0) ? KISSMALLOC_GRANULARITY : round_up_pow2(size, KISSMALLOC_GRANULARITY);
 
-void *KISSMALLOC_NAME(malloc)(size_t size)
-{
-    #ifdef KISSMALLOC_HISTOGRAM
-    histogram_sample(size);
-    #endif
+    if (size > (size_t)(arena->end - arena->top)) {
+        void *data = arena_advance(arena, size);
+        if (data == NULL) errno = ENOMEM;
+        return data;
+    }
 
-    const size_t page_size = page_size_get();
+    void *data = arena->top;
+    arena->top += size;
+    return data;
+}
 
-    if (KISSMALLOC_LIKELY(size < page_size >> 1))
-    {
-        if (KISSMALLOC_UNLIKELY(size == 0)) return NULL;
+/** Release all blocks of arena at once: all chunks but the first one are unmapped and the first one is handed
+  * back to the kernel, so that it is filled with clean pages again
+  */
+void kiss_arena_reset(struct kiss_arena_t *arena)
+{
+    const size_t page_size = page_size_get();
 
-        size = round_up_pow2(size, KISSMALLOC_GRANULARITY);
+    uint8_t *top = (arena->head == &arena->chunk) ? arena->top : (uint8_t *)arena + arena->chunk.size;
 
-        struct bucket_t *bucket = bucket_get_mine(page_size);
+    arena_chunks_unmap(arena);
 
-        if (KISSMALLOC_LIKELY(size <= bucket->bytes_free)) {
-            void *data = (uint8_t *)bucket + page_size - bucket->bytes_free;
-            bucket->bytes_free -= size;
-            ++bucket->object_count;
-            return data;
-        }
+    uint8_t *start = (uint8_t *)arena + arena_header_size_get();
 
-        return bucket_advance(bucket, page_size, size);
+    #ifndef KISSMALLOC_DIRTY_PAGES
+    uint8_t *clean = (uint8_t *)arena + page_size;
+    if (top > clean) {
+        if (sys_madvise(clean, round_up_pow2(top - clean, page_size), MADV_DONTNEED) == -1) abort();
+        top = clean;
     }
-    else if (size <= page_size - KISSMALLOC_GRANULARITY)
-    {
-        size = round_up_pow2(size, KISSMALLOC_GRANULARITY);
-
-        struct bucket_t *bucket = bucket_get_mine(page_size);
+    if (top > start) memset(start, 0, top - start);
+    #else
+    (void)page_size;
+    (void)top;
+    #endif
 
-        if (size <= bucket->bytes_free) {
-            void *data = (uint8_t *)bucket + page_size - bucket->bytes_free;
-            bucket->bytes_free -= size;
-            ++bucket->object_count;
-            return data;
-        }
+    arena->chunk.next = NULL;
+    arena->head = &arena->chunk;
+    arena->top = start;
+    arena->end = (uint8_t *)arena + arena->chunk.size;
+}
 
-        return bucket_advance(bucket, page_size, size);
-    }
+/** Release all blocks of arena and the arena itself
+  */
+void kiss_arena_destroy(struct kiss_arena_t *arena)
+{
+    if (arena == NULL) return;
+    arena_chunks_unmap(arena);
+    arena_chunk_unmap(&arena->chunk);
+}
 
-    size = round_up_pow2(size, page_size) + page_size;
+/** Begin a new scope, in which small blocks allocated by the calling thread via malloc(), calloc() or realloc()
+  * are taken from a region of the scope (returns 0 on success or -1 and sets errno)
+  */
+int kiss_scope_begin()
+{
+    #ifdef KISSMALLOC_SCOPES
+    const size_t page_size = page_size_get();
 
-    void *head = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-    if (KISSMALLOC_UNLIKELY(head == MAP_FAILED)) {
+    struct scope_t *scope = (struct scope_t *)scope_run_map(page_size);
+    if (scope == NULL) {
         errno = ENOMEM;
-        return NULL;
+        return -1;
     }
-    *(size_t *)head = size;
 
-    usage_add(size);
+    scope->run.next = NULL;
+    scope->parent = scope_current;
+    scope->page_next = (uint8_t *)scope + page_size;
+    scope->page_end = (uint8_t *)scope + run_size_get(page_size);
+    scope->bucket = scope_bucket_create(scope, page_size);
 
-    return (uint8_t *)head + page_size;
+    scope_current = scope;
+
+    return 0;
+    #else
+    errno = ENOSYS;
+    return -1;
+    #endif
 }
 
-void KISSMALLOC_NAME(free)(void *ptr)
+/** End the innermost scope of the calling thread and release all blocks allocated in it
+  */
+void kiss_scope_end()
 {
-    if (ptr == NULL) return;
+    #ifdef KISSMALLOC_SCOPES
+    struct scope_t *scope = scope_current;
+    if (scope == NULL) return;
+
+    scope_current = scope->parent;
 
     const size_t page_size = page_size_get();
-    const size_t page_offset = (size_t)(((uint8_t *)ptr - (uint8_t *)NULL) & (page_size - 1));
 
-    if (KISSMALLOC_LIKELY(page_offset != 0)) {
-        void *page_start = (uint8_t *)ptr - page_offset;
-        struct bucket_t *bucket = (struct bucket_t *)page_start;
-        if (KISSMALLOC_UNLIKELY(!__sync_sub_and_fetch(&bucket->object_count, 1))) {
-            cache_push(bucket_get_mine(page_size)->cache, bucket, page_size);
-            usage_add(-page_size);
-        }
-    }
-    else if (ptr != NULL) {
-        void *head = (uint8_t *)ptr - page_size;
-        size_t size = *(size_t *)head;
-        if (munmap(head, size) == -1) abort();
-        usage_add(-size);
+    for (struct scope_run_t *run = scope->run.next; run != NULL;) {
+        struct scope_run_t *next = run->next;
+        scope_run_unmap(run, page_size);
+        run = next;
     }
+    scope_run_unmap(&scope->run, page_size);
+    #endif
 }
 
-void *KISSMALLOC_NAME(calloc)(size_t number, size_t size)
+/** Move the block at ptr out of the innermost scope of the calling thread into the enclosing one, so that it outlives
+  * the scope (returns the new location of the block or ptr itself if the block does not belong to a scope)
+  */
+void *kiss_scope_escape(void *ptr)
 {
-    return KISSMALLOC_NAME(malloc)(number * size);
+    #ifdef KISSMALLOC_SCOPES
+    if (ptr == NULL || scope_current == NULL) return ptr;
+
+    const size_t page_size = page_size_get();
+    if (!scope_owns(ptr, page_size)) return ptr;
+
+    const size_t size = block_size_get(ptr, page_size);
+
+    struct scope_t *scope = scope_current;
+    scope_current = scope->parent;
+    void *new_ptr = KISSMALLOC_NAME(malloc)(size);
+    scope_current = scope;
+
+    if (new_ptr != NULL) memcpy(new_ptr, ptr, size);
+
+    return new_ptr;
+    #else
+    return ptr;
+    #endif
 }
 
-void *KISSMALLOC_NAME(realloc)(void *ptr, size_t size)
+/** Hand back the cached pages beyond pad bytes, the unused preallocated pages and the cached large mappings of all zones
+  * within reach: all zones if KISSMALLOC_DECAY_TIME > 0, otherwise the zone of the calling thread, the per-CPU zones and
+  * the zones in the depot (returns 1 if any memory has been handed back, 0 otherwise)
+  */
+int KISSMALLOC_NAME(malloc_trim)(size_t pad)
 {
-    if (ptr == NULL) return KISSMALLOC_NAME(malloc)(size);
-
-    if (size == 0) {
-        if (ptr != NULL) KISSMALLOC_NAME(free)(ptr);
-        return NULL;
+    const size_t page_size = page_size_get();
+    const uint32_t fill_max = (pad / page_size < KISSMALLOC_PAGE_CACHE) ? pad / page_size : KISSMALLOC_PAGE_CACHE;
+
+    int released = 0;
+
+    #ifdef KISSMALLOC_DECAY
+    while (__sync_lock_test_and_set(&cache_registry_lock, 1)) sched_yield(); // no zone lock is taken after this one
+    for (struct cache_t *cache = cache_registry; cache != NULL; cache = cache->registry_next) {
+        #ifdef KISSMALLOC_REMOTE_FREE
+        cache_remote_drain(cache, page_size);
+        #endif
+        cache_lock(cache);
+        released |= cache_trim(cache, fill_max, page_size);
+        cache_unlock(cache);
+    }
+    __sync_lock_release(&cache_registry_lock);
+    #else
+    #ifdef KISSMALLOC_PER_CPU
+    if (__atomic_load_n(&cpu_zone, __ATOMIC_ACQUIRE) != NULL) {
+        for (int i = 0; i < cpu_zone_count; ++i) {
+            struct cpu_zone_t *zone = &cpu_zone[i];
+            while (!__sync_bool_compare_and_swap(&zone->lock, 0, 1)) sched_yield();
+            if (zone->bucket != NULL) {
+                #ifdef KISSMALLOC_REMOTE_FREE
+                cache_remote_drain(zone->bucket->cache, page_size);
+                #endif
+                released |= cache_trim(zone->bucket->cache, fill_max, page_size);
+            }
+            __sync_lock_release(&zone->lock);
+        }
+    }
+    #else
+    struct bucket_t *bucket = bucket_current_get();
+    if (bucket != NULL) {
+        #ifdef KISSMALLOC_REMOTE_FREE
+        cache_remote_drain(bucket->cache, page_size);
+        #endif
+        released |= cache_trim(bucket->cache, fill_max, page_size);
+    }
+    #endif
+    #ifdef KISSMALLOC_DEPOT
+    struct cache_t *adopted = NULL;
+    for (int node = 0; node < KISSMALLOC_DEPOT_COUNT; ++node) {
+        for (struct cache_t *cache; (cache = cache_depot_pop(node)) != NULL;) {
+            #ifdef KISSMALLOC_REMOTE_FREE
+            cache_remote_drain(cache, page_size);
+            #endif
+            released |= cache_trim(cache, fill_max, page_size);
+            cache->depot_next = adopted;
+            adopted = cache;
+        }
     }
+    while (adopted != NULL) {
+        struct cache_t *next = adopted->depot_next;
+        cache_depot_push(adopted);
+        adopted = next;
+    }
+    #endif
+    #endif // KISSMALLOC_DECAY
 
-    if (size <= KISSMALLOC_GRANULARITY) return ptr;
+    return released;
+}
 
+/** Hand back the cached pages, the unused preallocated pages and the cached large mappings of the calling thread's zone,
+  * e.g. before the thread blocks for a long time
+  */
+void kissmalloc_thread_idle()
+{
     const size_t page_size = page_size_get();
-    size_t copy_size = page_size;
-    size_t page_offset = (size_t)((uint8_t *)ptr - (uint8_t *)NULL) & (page_size - 1);
 
-    if (page_offset > 0) {
-        void *page_start = (uint8_t *)ptr - page_offset;
-        struct bucket_t *bucket = (struct bucket_t *)page_start;
-        const size_t size_estimate_1 = page_size - bucket->bytes_free - page_offset;
-        const size_t size_estimate_2 = page_size - bucket->bytes_free - ((bucket->object_count - 1) << KISSMALLOC_GRANULARITY_SHIFT);
-            // might not work cleanly when reallocating in a different thread
-        copy_size = (size_estimate_1 < size_estimate_2) ? size_estimate_1 : size_estimate_2;
-    }
+    #ifndef KISSMALLOC_PER_CPU
+    if (bucket_current_get() == NULL) return;
+    #endif
 
-    if (copy_size > size) copy_size = size;
+    struct cache_t *cache = bucket_get_mine(page_size)->cache;
 
-    void *new_ptr = KISSMALLOC_NAME(malloc)(size);
-    if (new_ptr == NULL) return NULL;
+    #ifdef KISSMALLOC_REMOTE_FREE
+    cache_remote_drain(cache, page_size);
+    #endif
 
-    memcpy(new_ptr, ptr, copy_size);
+    cache_lock(cache);
+    cache_trim(cache, 0, page_size);
+    cache_unlock(cache);
 
-    KISSMALLOC_NAME(free)(ptr);
+    bucket_put_mine(cache);
 
-    return new_ptr;
+    usage_flush();
 }
 
-int KISSMALLOC_NAME(posix_memalign)(void **ptr, size_t alignment, size_t size)
+/** Number of bytes allocated minus number of bytes freed by the calling thread
+  */
+ssize_t KISSMALLOC_NAME(memsource)()
 {
-    if (size == 0) {
-        *ptr = NULL;
-        return 0;
-    }
+    const size_t page_size = page_size_get();
+    struct bucket_t *bucket = bucket_get_mine(page_size);
+    const ssize_t offset = (bucket->object_count == 0) ? -(ssize_t)page_size : 0;
+    bucket_put_mine(bucket->cache);
+    #ifdef KISSMALLOC_TLS
+    return source_current + offset;
+    #else
+    return (uint8_t *)pthread_getspecific(source_key) - (uint8_t *)NULL + offset;
+    #endif
+}
 
-    if (
-        !KISSMALLOC_IS_POW2(alignment) ||
-        (alignment & (sizeof(void *) - 1)) != 0
-    )
-        return EINVAL;
+/** Number of bytes allocated minus number of bytes freed (approximately, if KISSMALLOC_USAGE_BATCH > 0)
+  */
+size_t KISSMALLOC_NAME(memusage)()
+{
+    size_t bytes = 0;
+    for (int i = 0; i < KISSMALLOC_USAGE_SHARDS; ++i)
+        bytes += __atomic_load_n(&usage_shard[i].bytes, __ATOMIC_RELAXED);
+    return bytes;
+}
 
-    if (alignment <= KISSMALLOC_GRANULARITY) {
-        *ptr = KISSMALLOC_NAME(malloc)(size);
-        return (*ptr != NULL) ? 0 : ENOMEM;
-    }
+/** Number of memory mappings currently held, or 0 if KISSMALLOC_PAGE_RELEASE == 0: if freed pages are returned by
+  * munmap(2), releasing pages may split a run in two, shorten it or remove its last piece, which cannot be told apart
+  * without tracking the state of the neighbouring pages, so the mappings are not counted at all
+  */
+size_t KISSMALLOC_NAME(memmaps)()
+{
+    return __sync_add_and_fetch(&map_count, 0);
+}
 
-    const size_t page_size = page_size_get();
+/** Collect heap statistics (the values of the calling thread are exact, the process-wide values are a snapshot of
+  * counters updated concurrently)
+  */
+void kissmalloc_stats(struct kiss_stats *info)
+{
+    memset(info, 0, sizeof(struct kiss_stats));
 
-    if (alignment + size < page_size >> 1) {
-        uint8_t *ptr_byte = (uint8_t *)KISSMALLOC_NAME(malloc)(alignment + size);
-        if (ptr_byte != NULL) {
-            size_t r = (size_t)(ptr_byte - (uint8_t *)NULL) & (alignment - 1);
-            if (r > 0) ptr_byte += alignment - r;
-            *ptr = ptr_byte;
-            return 0;
-        }
-    }
+    const size_t page_size = page_size_get();
 
-    size += alignment + page_size;
+    /// a thread, which has not allocated anything yet, is not given a zone just for reporting its statistics
+    #ifdef KISSMALLOC_PER_CPU
+    const int has_zone = (__atomic_load_n(&cpu_zone, __ATOMIC_ACQUIRE) != NULL);
+    #else
+    const int has_zone = (bucket_current_get() != NULL);
+    #endif
 
-    void *head = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-    if (head == MAP_FAILED) return ENOMEM;
+    if (has_zone) {
+        info->thread_source = KISSMALLOC_NAME(memsource)();
 
-    while (
-        (
-            (((uint8_t *)head - (uint8_t *)NULL) + page_size)
-            & (alignment - 1)
-        ) != 0
-    ) {
-        if (munmap(head, page_size) == -1) abort();
-        head = (uint8_t *)head + page_size;
-        size -= page_size;
+        struct bucket_t *bucket = bucket_get_mine(page_size);
+        struct cache_t *cache = bucket->cache;
+        info->thread_buckets = 1;
+        #ifdef KISSMALLOC_SIZE_CLASSES
+        for (int i = 0; i < KISSMALLOC_SIZE_CLASS_COUNT; ++i) {
+            if (cache->class_bucket[i]) ++info->thread_buckets;
+        }
+        #endif
+        cache_lock(cache);
+        info->thread_cached_pages = cache->fill;
+        info->thread_prealloc_pages = cache->prealloc_count;
+        cache_unlock(cache);
+        bucket_put_mine(cache);
     }
 
-    *(size_t *)head = size;
-    *ptr = (uint8_t *)head + page_size;
-    return 0;
+    for (int i = 0; i < KISSMALLOC_USAGE_SHARDS; ++i) {
+        const struct usage_shard_t *shard = &usage_shard[i];
+        info->live_pages += __atomic_load_n(&shard->pages_live, __ATOMIC_RELAXED);
+        info->cached_pages += __atomic_load_n(&shard->pages_cached, __ATOMIC_RELAXED);
+        info->prealloc_pages += __atomic_load_n(&shard->pages_prealloc, __ATOMIC_RELAXED);
+        info->large_count += __atomic_load_n(&shard->large_count, __ATOMIC_RELAXED);
+        info->large_bytes += __atomic_load_n(&shard->large_bytes, __ATOMIC_RELAXED);
+        info->zone_count += __atomic_load_n(&shard->zone_count, __ATOMIC_RELAXED);
+        info->mapped_bytes += __atomic_load_n(&shard->mapped_bytes, __ATOMIC_RELAXED);
+        info->mmap_calls += __atomic_load_n(&shard->mmap_calls, __ATOMIC_RELAXED);
+        info->munmap_calls += __atomic_load_n(&shard->munmap_calls, __ATOMIC_RELAXED);
+        info->madvise_calls += __atomic_load_n(&shard->madvise_calls, __ATOMIC_RELAXED);
+        info->mremap_calls += __atomic_load_n(&shard->mremap_calls, __ATOMIC_RELAXED);
+        info->pages_released += __atomic_load_n(&shard->pages_released, __ATOMIC_RELAXED);
+    }
+    info->usage = KISSMALLOC_NAME(memusage)();
+    info->mapped_peak = __atomic_load_n(&mapped_peak, __ATOMIC_RELAXED);
+    if (info->mapped_peak < info->mapped_bytes) info->mapped_peak = info->mapped_bytes;
+    info->maps = KISSMALLOC_NAME(memmaps)();
 }
 
-void *KISSMALLOC_NAME(aligned_alloc)(size_t alignment, size_t size)
+/** Heap statistics in the format of glibc's mallinfo2(): memory in use and free memory is split into the pages used
+  * for small objects (arena, uordblks, fordblks) and the mappings of large blocks (hblks, hblkhd)
+  */
+struct KISSMALLOC_NAME(mallinfo2) KISSMALLOC_NAME(mallinfo2)()
 {
-    void *ptr = NULL;
-    KISSMALLOC_NAME(posix_memalign)(&ptr, alignment, size);
-    return ptr;
-}
+    const size_t page_size = page_size_get();
 
-void *KISSMALLOC_NAME(memalign)(size_t alignment, size_t size)
-{
-    void *ptr = NULL;
-    KISSMALLOC_NAME(posix_memalign)(&ptr, alignment, size);
-    return ptr;
+    struct kiss_stats info;
+    kissmalloc_stats(&info);
+
+    struct KISSMALLOC_NAME(mallinfo2) mi;
+    memset(&mi, 0, sizeof(mi));
+    mi.arena = (info.mapped_bytes > info.large_bytes) ? info.mapped_bytes - info.large_bytes : 0;
+    mi.ordblks = info.cached_pages;
+    mi.hblks = info.large_count;
+    mi.hblkhd = info.large_bytes;
+    mi.uordblks = (info.usage > info.large_bytes) ? info.usage - info.large_bytes : 0;
+    mi.fordblks = (info.cached_pages + info.prealloc_pages) * page_size;
+    mi.keepcost = info.prealloc_pages * page_size;
+    return mi;
 }
 
-void *KISSMALLOC_NAME(valloc)(size_t size)
+#ifdef KISSMALLOC_OVERLOAD_LIBC
+
+/** Print a summary of the heap statistics to stderr (without libc overloading the name would collide with
+  * kissmalloc_stats(), which returns the same figures and more)
+  */
+void malloc_stats()
 {
-    return KISSMALLOC_NAME(malloc)(round_up_pow2(size, page_size_get()));
+    struct kiss_stats info;
+    kissmalloc_stats(&info);
+
+    const char *name[] = {
+        "system bytes     = ",
+        "in use bytes     = ",
+        "max system bytes = ",
+        "mmap regions     = ",
+        "mmap bytes       = ",
+        "zones            = "
+    };
+    const size_t value[] = {
+        info.mapped_bytes,
+        info.usage,
+        info.mapped_peak,
+        info.large_count,
+        info.large_bytes,
+        info.zone_count
+    };
+
+    char text[512];
+    char *cursor = text;
+    for (int i = 0; i < (int)(sizeof(value) / sizeof(value[0])); ++i) {
+        cursor = trace_text(name[i], cursor);
+        cursor = trace_value(value[i], cursor);
+        cursor = trace_text("\n", cursor);
+    }
+    write(2, text, cursor - text);
 }
 
-void *KISSMALLOC_NAME(pvalloc)(size_t size)
+#endif // KISSMALLOC_OVERLOAD_LIBC
+
+static char *trace_element(const char *tag, const char *type, size_t count, size_t size, char *eoi)
 {
-    return KISSMALLOC_NAME(malloc)(round_up_pow2(size, page_size_get()));
+    eoi = trace_text("<", eoi);
+    eoi = trace_text(tag, eoi);
+    eoi = trace_text(" type=\"", eoi);
+    eoi = trace_text(type, eoi);
+    if (count != (size_t)-1) {
+        eoi = trace_text("\" count=\"", eoi);
+        eoi = trace_value(count, eoi);
+    }
+    eoi = trace_text("\" size=\"", eoi);
+    eoi = trace_value(size, eoi);
+    eoi = trace_text("\"/>\n", eoi);
+    return eoi;
 }
 
-/** Number of bytes allocated minus number of bytes freed by the calling thread
+/** Write the heap statistics to stream as XML in the layout of glibc's malloc_info() (options needs to be 0,
+  * returns 0 on success and -1 on failure)
   */
-ssize_t KISSMALLOC_NAME(memsource)()
+int KISSMALLOC_NAME(malloc_info)(int options, FILE *stream)
 {
+    if (options != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
     const size_t page_size = page_size_get();
-    const ssize_t offset = (bucket_get_mine(page_size)->object_count == 1) ? -(ssize_t)page_size : 0;
-    return (uint8_t *)pthread_getspecific(source_key) - (uint8_t *)NULL + offset;
+
+    struct kiss_stats info;
+    kissmalloc_stats(&info);
+
+    char text[1024];
+    char *cursor = text;
+    cursor = trace_text("<malloc version=\"1\">\n", cursor);
+    cursor = trace_element("total", "fast", 0, 0, cursor);
+    cursor = trace_element("total", "rest", info.cached_pages, info.cached_pages * page_size, cursor);
+    cursor = trace_element("total", "prealloc", info.prealloc_pages, info.prealloc_pages * page_size, cursor);
+    cursor = trace_element("total", "mmap", info.large_count, info.large_bytes, cursor);
+    cursor = trace_element("system", "current", (size_t)-1, info.mapped_bytes, cursor);
+    cursor = trace_element("system", "max", (size_t)-1, info.mapped_peak, cursor);
+    cursor = trace_element("aspace", "total", (size_t)-1, info.mapped_bytes, cursor);
+    cursor = trace_element("aspace", "mprotect", (size_t)-1, 0, cursor); // no memory is ever mprotect(2)ed
+    cursor = trace_text("</malloc>\n", cursor);
+
+    return (fwrite(text, 1, cursor - text, stream) == (size_t)(cursor - text)) ? 0 : -1;
 }
 
-/** Number of bytes allocated minus number of bytes freed
+/** Adjust a tuning parameter at runtime (returns 1 on success and 0 if the parameter or value is not supported):
+  *   - KISS_M_TRIM_THRESHOLD: bytes of freed pages each zone keeps cached (up to KISSMALLOC_PAGE_CACHE pages)
+  *   - KISS_M_TOP_PAD: bytes of further pages to map along with a page needed right now (between KISSMALLOC_RUN_MIN - 1 and
+  *     KISSMALLOC_PAGE_PREALLOC - 1 pages, KISSMALLOC_PAGE_RELEASE == 0 only)
+  *   - KISS_M_MMAP_THRESHOLD: size of the largest mapping kept in the large allocation cache (up to KISSMALLOC_LARGE_CACHE)
+  *   - KISS_M_ARENA_MAX: number of per-CPU zones in use (KISSMALLOC_PER_CPU only)
   */
-size_t KISSMALLOC_NAME(memusage)()
+int KISSMALLOC_NAME(mallopt)(int param, int value)
 {
-    return __sync_add_and_fetch(&usage_total, 0);
+    if (value < 0) return 0;
+
+    const size_t page_size = page_size_get();
+
+    switch (param) {
+        case KISS_M_TRIM_THRESHOLD: {
+            const uint32_t fill_max = ((size_t)value / page_size < KISSMALLOC_PAGE_CACHE) ? (size_t)value / page_size : KISSMALLOC_PAGE_CACHE;
+            __atomic_store_n(&tuning.page_cache, fill_max, __ATOMIC_RELAXED);
+            return 1;
+        }
+        #if KISSMALLOC_PAGE_RELEASE == 0
+        case KISS_M_TOP_PAD: {
+            __atomic_store_n(&tuning.page_prealloc, (size_t)value / page_size, __ATOMIC_RELAXED);
+            return 1;
+        }
+        #endif
+        #if KISSMALLOC_LARGE_CACHE > 0
+        case KISS_M_MMAP_THRESHOLD: {
+            const size_t size_max = ((size_t)value < KISSMALLOC_LARGE_CACHE) ? (size_t)value : KISSMALLOC_LARGE_CACHE;
+            __atomic_store_n(&tuning.large_cache, size_max, __ATOMIC_RELAXED);
+            return 1;
+        }
+        #endif
+        #ifdef KISSMALLOC_PER_CPU
+        case KISS_M_ARENA_MAX: {
+            if (value == 0) return 0;
+            pthread_once(&library_init_control, library_init);
+            __atomic_store_n(&cpu_zone_used, (value < cpu_zone_count) ? value : cpu_zone_count, __ATOMIC_RELAXED);
+            return 1;
+        }
+        #endif
+    }
+
+    return 0;
 }
@@ -19,23 +19,117 @@
 
 #include <sys/types.h>
 
+struct _IO_FILE; // FILE, without pulling in <stdio.h>
+struct mallinfo2; // complete type in <malloc.h>, if KISSMALLOC_OVERLOAD_LIBC
+
+/// Exception specification of the libc declarations, so C++ code may include the libc headers after this header
+#if defined(__cplusplus) && defined(KISSMALLOC_OVERLOAD_LIBC) && defined(__THROW)
+#define KISSMALLOC_LIBC_THROW __THROW
+#else
+#define KISSMALLOC_LIBC_THROW
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void *KISSMALLOC_NAME(malloc)(size_t size);
-void KISSMALLOC_NAME(free)(void *ptr);
-void *KISSMALLOC_NAME(calloc)(size_t number, size_t size);
-void *KISSMALLOC_NAME(realloc)(void *ptr, size_t size);
-int KISSMALLOC_NAME(posix_memalign)(void **ptr, size_t alignment, size_t size);
+void *KISSMALLOC_NAME(malloc)(size_t size) KISSMALLOC_LIBC_THROW;
+void KISSMALLOC_NAME(free)(void *ptr) KISSMALLOC_LIBC_THROW;
+void KISSMALLOC_NAME(free_sized)(void *ptr, size_t size) KISSMALLOC_LIBC_THROW;
+void KISSMALLOC_NAME(free_aligned_sized)(void *ptr, size_t alignment, size_t size) KISSMALLOC_LIBC_THROW;
+void *KISSMALLOC_NAME(calloc)(size_t number, size_t size) KISSMALLOC_LIBC_THROW;
+void *KISSMALLOC_NAME(realloc)(void *ptr, size_t size) KISSMALLOC_LIBC_THROW;
+int KISSMALLOC_NAME(posix_memalign)(void **ptr, size_t alignment, size_t size) KISSMALLOC_LIBC_THROW;
 
-void *KISSMALLOC_NAME(aligned_alloc)(size_t alignment, size_t size);
-void *KISSMALLOC_NAME(memalign)(size_t alignment, size_t size);
-void *KISSMALLOC_NAME(valloc)(size_t size);
-void *KISSMALLOC_NAME(pvalloc)(size_t size);
+void *KISSMALLOC_NAME(aligned_alloc)(size_t alignment, size_t size) KISSMALLOC_LIBC_THROW;
+void *KISSMALLOC_NAME(memalign)(size_t alignment, size_t size) KISSMALLOC_LIBC_THROW;
+void *KISSMALLOC_NAME(valloc)(size_t size) KISSMALLOC_LIBC_THROW;
+void *KISSMALLOC_NAME(pvalloc)(size_t size) KISSMALLOC_LIBC_THROW;
+size_t KISSMALLOC_NAME(malloc_usable_size)(void *ptr) KISSMALLOC_LIBC_THROW;
+int KISSMALLOC_NAME(malloc_trim)(size_t pad) KISSMALLOC_LIBC_THROW;
 
 ssize_t KISSMALLOC_NAME(memsource)();
 size_t KISSMALLOC_NAME(memusage)();
+size_t KISSMALLOC_NAME(memmaps)();
+
+/** Heap statistics as reported by kissmalloc_stats()
+  */
+struct kiss_stats {
+    size_t thread_buckets; ///< pages the calling thread currently allocates from
+    size_t thread_cached_pages; ///< freed pages kept in the page cache of the calling thread's zone
+    size_t thread_prealloc_pages; ///< untouched pages left in the preallocated run of the calling thread's zone
+    ssize_t thread_source; ///< bytes allocated minus bytes freed by the calling thread
+    size_t usage; ///< bytes allocated minus bytes freed
+    size_t live_pages; ///< pages holding small objects
+    size_t cached_pages; ///< freed pages kept in the page caches of all zones
+    size_t prealloc_pages; ///< untouched pages left in the preallocated runs of all zones
+    size_t large_count; ///< large blocks in use
+    size_t large_bytes; ///< bytes mapped for large blocks in use (including their header pages)
+    size_t zone_count; ///< zones (each thread or CPU has one, zones of exited threads may be kept for reuse)
+    size_t mapped_bytes; ///< bytes currently mapped from the system
+    size_t mapped_peak; ///< highest number of bytes mapped from the system (as seen whenever memory got mapped)
+    size_t maps; ///< memory mappings currently held, 0 if KISSMALLOC_PAGE_RELEASE == 0 (see memmaps())
+    size_t mmap_calls; ///< number of mmap(2) calls so far
+    size_t munmap_calls; ///< number of munmap(2) calls so far
+    size_t madvise_calls; ///< number of madvise(2) calls so far
+    size_t mremap_calls; ///< number of mremap(2) calls so far
+    size_t pages_released; ///< pages handed back to the system from page caches so far
+};
+
+void kissmalloc_stats(struct kiss_stats *stats);
+
+#ifndef KISSMALLOC_OVERLOAD_LIBC
+/** Heap statistics as reported by kissmallinfo2(), layout compatible with glibc's struct mallinfo2
+  */
+struct kissmallinfo2 {
+    size_t arena; ///< bytes mapped for small objects
+    size_t ordblks; ///< freed pages kept in the page caches
+    size_t smblks; ///< unused (0)
+    size_t hblks; ///< large blocks in use
+    size_t hblkhd; ///< bytes mapped for large blocks in use
+    size_t usmblks; ///< unused (0)
+    size_t fsmblks; ///< unused (0)
+    size_t uordblks; ///< bytes allocated for small objects
+    size_t fordblks; ///< bytes of cached and preallocated pages
+    size_t keepcost; ///< bytes of preallocated pages
+};
+#endif
+
+struct KISSMALLOC_NAME(mallinfo2) KISSMALLOC_NAME(mallinfo2)() KISSMALLOC_LIBC_THROW;
+#ifdef KISSMALLOC_OVERLOAD_LIBC
+void malloc_stats() KISSMALLOC_LIBC_THROW;
+#endif
+int KISSMALLOC_NAME(malloc_info)(int options, struct _IO_FILE *stream) KISSMALLOC_LIBC_THROW;
+int KISSMALLOC_NAME(mallopt)(int param, int value) KISSMALLOC_LIBC_THROW;
+
+/// Parameters understood by mallopt(), same values as the corresponding M_* constants of glibc's <malloc.h>
+#define KISS_M_TRIM_THRESHOLD -1
+#define KISS_M_TOP_PAD -2
+#define KISS_M_MMAP_THRESHOLD -3
+#define KISS_M_ARENA_MAX -8
+
+size_t kissexpand(void *ptr, size_t min_size, size_t max_size);
+size_t kissgoodsize(size_t size);
+
+void kissmalloc_thread_idle();
+
+size_t kissmalloc_bulk(size_t size, size_t count, void **ptrs);
+void kissfree_bulk(void **ptrs, size_t count);
+
+void *kissmalloc_onnode(size_t size, int node);
+int kissmalloc_node_count();
+size_t kissmemusage_onnode(int node);
+
+struct kiss_arena_t;
+
+struct kiss_arena_t *kiss_arena_create();
+void *kiss_arena_malloc(struct kiss_arena_t *arena, size_t size);
+void kiss_arena_reset(struct kiss_arena_t *arena);
+void kiss_arena_destroy(struct kiss_arena_t *arena);
+
+int kiss_scope_begin();
+void kiss_scope_end();
+void *kiss_scope_escape(void *ptr);
 
 #ifdef __cplusplus
 } // extern "C"
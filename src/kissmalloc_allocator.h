@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2019 Frank Mertens.
+ *
+ * Distribution and use is allowed under the terms of the zlib license
+ * (see kissmalloc/LICENSE).
+ *
+ */
+
+#pragma once
+
+/// C++ allocator interface, kept apart from kissmalloc.h, so that the C declarations of kissmalloc.h do not meet the
+/// standard library's own declarations of malloc() and friends when libc is overloaded
+
+#include <memory>
+#include <new>
+
+#include "kissmalloc.h"
+
+#ifdef __cpp_lib_allocate_at_least
+template<class Pointer>
+using kiss_allocation_result = std::allocation_result<Pointer>;
+#else
+template<class Pointer>
+struct kiss_allocation_result {
+    Pointer ptr;
+    std::size_t count;
+};
+#endif
+
+/** Allocate at least size bytes by operator new and store the number of usable bytes in allocated_size
+  */
+void *kiss_allocate_at_least(std::size_t size, std::size_t *allocated_size);
+
+/** Standard allocator, which also provides the C++23 allocate_at_least()
+  */
+template<class T>
+class kiss_allocator {
+public:
+    typedef T value_type;
+
+    kiss_allocator() noexcept {}
+    template<class U> kiss_allocator(const kiss_allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n)
+    {
+        if (n > static_cast<std::size_t>(-1) / sizeof(T)) throw std::bad_alloc();
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    kiss_allocation_result<T *> allocate_at_least(std::size_t n)
+    {
+        if (n > static_cast<std::size_t>(-1) / sizeof(T)) throw std::bad_alloc();
+        std::size_t size = 0;
+        T *ptr = static_cast<T *>(kiss_allocate_at_least(n * sizeof(T), &size));
+        return kiss_allocation_result<T *>{ptr, size / sizeof(T)};
+    }
+
+    void deallocate(T *ptr, std::size_t) noexcept
+    {
+        ::operator delete(ptr);
+    }
+};
+
+template<class T, class U>
+inline bool operator==(const kiss_allocator<T> &, const kiss_allocator<U> &) noexcept { return true; }
+
+template<class T, class U>
+inline bool operator!=(const kiss_allocator<T> &, const kiss_allocator<U> &) noexcept { return false; }
@@ -6,9 +6,7 @@
  *
  */
 
-#include "kissmalloc.h"
-
-#include <new>
+#include "kissmalloc_allocator.h" // includes the standard headers ahead of kissmalloc.h
 
 #ifndef KISSMALLOC_VALGRIND
 #ifndef NDEBUG
@@ -99,6 +97,17 @@ void *operator new[](std::size_t size, const std::nothrow_t &) KISSMALLOC_NOEXCE
     return data;
 }
 
+void *kiss_allocate_at_least(std::size_t size, std::size_t *allocated_size)
+{
+    void *data = operator new(size);
+    #ifndef KISSMALLOC_VALGRIND
+    *allocated_size = KISSMALLOC_NAME(malloc_usable_size)(data);
+    #else
+    *allocated_size = data ? size : 0; // keep the block exactly as large as announced to valgrind
+    #endif
+    return data;
+}
+
 #if __cplusplus >= 201703L // since C++17
 
 void *operator new(std::size_t size, std::align_val_t alignment)
@@ -252,7 +261,7 @@ void operator delete[](void *data, const std::nothrow_t &) KISSMALLOC_NOEXCEPT
 void operator delete(void *data, std::size_t size) noexcept
 {
     #ifndef KISSMALLOC_VALGRIND
-    KISSMALLOC_NAME(free)(data);
+    KISSMALLOC_NAME(free_sized)(data, size);
     #else
     #ifdef KISSMALLOC_OVERLOAD_LIBC
     free(data);
@@ -260,7 +269,7 @@ void operator delete(void *data, std::size_t size) noexcept
     #if KISSMALLOC_REDZONE_SIZE > 0
     if (data == nullptr) return;
     #endif
-    KISSMALLOC_NAME(free)((void *)((char *)data - KISSMALLOC_REDZONE_SIZE));
+    KISSMALLOC_NAME(free_sized)((void *)((char *)data - KISSMALLOC_REDZONE_SIZE), size + 2 * KISSMALLOC_REDZONE_SIZE);
     VALGRIND_FREELIKE_BLOCK(data, KISSMALLOC_REDZONE_SIZE);
     #endif
     #endif
@@ -269,7 +278,7 @@ void operator delete(void *data, std::size_t size) noexcept
 void operator delete[](void *data, std::size_t size) noexcept
 {
     #ifndef KISSMALLOC_VALGRIND
-    KISSMALLOC_NAME(free)(data);
+    KISSMALLOC_NAME(free_sized)(data, size);
     #else
     #ifdef KISSMALLOC_OVERLOAD_LIBC
     free(data);
@@ -277,7 +286,7 @@ void operator delete[](void *data, std::size_t size) noexcept
     #if KISSMALLOC_REDZONE_SIZE > 0
     if (data == nullptr) return;
     #endif
-    KISSMALLOC_NAME(free)((void *)((char *)data - KISSMALLOC_REDZONE_SIZE));
+    KISSMALLOC_NAME(free_sized)((void *)((char *)data - KISSMALLOC_REDZONE_SIZE), size + 2 * KISSMALLOC_REDZONE_SIZE);
     VALGRIND_FREELIKE_BLOCK(data, KISSMALLOC_REDZONE_SIZE);
     #endif
     #endif
@@ -324,7 +333,7 @@ void operator delete[](void *data, std::align_val_t alignment) noexcept
 void operator delete(void *data, std::size_t size, std::align_val_t alignment) noexcept
 {
     #ifndef KISSMALLOC_VALGRIND
-    KISSMALLOC_NAME(free)(data);
+    KISSMALLOC_NAME(free_aligned_sized)(data, static_cast<size_t>(alignment), size);
     #else
     #ifdef KISSMALLOC_OVERLOAD_LIBC
     free(data);
@@ -332,7 +341,7 @@ void operator delete(void *data, std::size_t size, std::align_val_t alignment) n
     #if KISSMALLOC_REDZONE_SIZE > 0
     if (data == nullptr) return;
     #endif
-    KISSMALLOC_NAME(free)((void *)((char *)data - KISSMALLOC_REDZONE_SIZE));
+    KISSMALLOC_NAME(free_aligned_sized)((void *)((char *)data - KISSMALLOC_REDZONE_SIZE), static_cast<size_t>(alignment), size + 2 * KISSMALLOC_REDZONE_SIZE);
     VALGRIND_FREELIKE_BLOCK(data, KISSMALLOC_REDZONE_SIZE);
     #endif
     #endif
@@ -341,7 +350,7 @@ void operator delete(void *data, std::size_t size, std::align_val_t alignment) n
 void operator delete[](void *data, std::size_t size, std::align_val_t alignment) noexcept
 {
     #ifndef KISSMALLOC_VALGRIND
-    KISSMALLOC_NAME(free)(data);
+    KISSMALLOC_NAME(free_aligned_sized)(data, static_cast<size_t>(alignment), size);
     #else
     #ifdef KISSMALLOC_OVERLOAD_LIBC
     free(data);
@@ -349,7 +358,7 @@ void operator delete[](void *data, std::size_t size, std::align_val_t alignment)
     #if KISSMALLOC_REDZONE_SIZE > 0
     if (data == nullptr) return;
     #endif
-    KISSMALLOC_NAME(free)((void *)((char *)data - KISSMALLOC_REDZONE_SIZE));
+    KISSMALLOC_NAME(free_aligned_sized)((void *)((char *)data - KISSMALLOC_REDZONE_SIZE), static_cast<size_t>(alignment), size + 2 * KISSMALLOC_REDZONE_SIZE);
     VALGRIND_FREELIKE_BLOCK(data, KISSMALLOC_REDZONE_SIZE);
     #endif
     #endif
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2019 Frank Mertens.
+ *
+ * Distribution and use is allowed under the terms of the zlib license
+ * (see kissmalloc/LICENSE).
+ *
+ */
+
+#include <kissmalloc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+static double time_get()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    const int round_count = 20000;
+    const int object_count = 256;
+    const size_t object_size = 48;
+
+    /// mimics a message decoder, which allocates the nodes of a packet and frees them together
+    void **object = malloc(object_count * sizeof(void *));
+
+    printf(
+        "kissmalloc bulk allocation benchmark\n"
+        "------------------------------------\n"
+        "\n"
+        "n = %d (number of objects per round)\n"
+        "r = %d (number of rounds)\n"
+        "s = %d (object size)\n"
+        "\n",
+        object_count,
+        round_count,
+        (int)object_size
+    );
+
+    double t_malloc = 0;
+    double t_free = 0;
+
+    for (int r = 0; r < round_count; ++r)
+    {
+        double t = time_get();
+
+        for (int i = 0; i < object_count; ++i)
+            object[i] = malloc(object_size);
+
+        t_malloc += time_get() - t;
+
+        t = time_get();
+
+        for (int i = 0; i < object_count; ++i)
+            free(object[i]);
+
+        t_free += time_get() - t;
+    }
+
+    double t_malloc_bulk = 0;
+    double t_free_bulk = 0;
+
+    for (int r = 0; r < round_count; ++r)
+    {
+        double t = time_get();
+
+        if (kissmalloc_bulk(object_size, object_count, object) != (size_t)object_count) {
+            fprintf(stderr, "kissmalloc_bulk() failed\n");
+            return 1;
+        }
+
+        t_malloc_bulk += time_get() - t;
+
+        t = time_get();
+
+        kissfree_bulk(object, object_count);
+
+        t_free_bulk += time_get() - t;
+    }
+
+    const double n = (double)object_count * round_count;
+
+    printf("malloc() speed:\n");
+    printf("  t/n = %f ns (average latency of an allocation by malloc())\n", t_malloc / n * 1e9);
+    printf("  t/n = %f ns (average latency of an allocation by kissmalloc_bulk())\n", t_malloc_bulk / n * 1e9);
+    printf("\n");
+    printf("free() speed:\n");
+    printf("  t/n = %f ns (average latency of a deallocation by free())\n", t_free / n * 1e9);
+    printf("  t/n = %f ns (average latency of a deallocation by kissfree_bulk())\n", t_free_bulk / n * 1e9);
+    printf("\n");
+
+    free(object);
+
+    return 0;
+}
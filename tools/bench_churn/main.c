@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2019 Frank Mertens.
+ *
+ * Distribution and use is allowed under the terms of the zlib license
+ * (see kissmalloc/LICENSE).
+ *
+ */
+
+/// Long-running single-threaded churn of a live set, with kissmalloc compiled in using free lists on size-class pages
+
+#define KISSMALLOC_REUSE
+
+#include "../../src/kissmalloc.c"
+#include <stdio.h>
+#include <time.h>
+
+static int random_get(const int a, const int b)
+{
+    const unsigned m = (1u << 31) - 1;
+    static unsigned x = 7;
+    x = (16807 * x) % m;
+    return ((uint64_t)x * (b - a)) / (m - 1) + a;
+}
+
+static double time_get()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    const int live_count = 20000;
+    const int iteration_count = 3000000;
+    const int size_max = 400;
+
+    char **live = (char **)calloc(live_count, sizeof(char *));
+
+    size_t usage_peak = 0;
+
+    const double t = time_get();
+
+    for (int i = 0; i < iteration_count; ++i) {
+        const int k = random_get(0, live_count);
+        free(live[k]);
+        live[k] = (char *)malloc(random_get(1, size_max));
+        const size_t usage = memusage();
+        if (usage_peak < usage) usage_peak = usage;
+    }
+
+    const double t_churn = time_get() - t;
+
+    printf(
+        "kissmalloc live set churn benchmark\n"
+        "-----------------------------------\n"
+        "\n"
+        "n = %d (number of live objects)\n"
+        "r = %d (number of objects replaced)\n"
+        "\n",
+        live_count,
+        iteration_count
+    );
+
+    printf("free() + malloc() speed:\n");
+    printf("  t/r = %f ns (average latency of replacing an object)\n", t_churn / iteration_count * 1e9);
+    printf("\n");
+    printf("memory held by the live set:\n");
+    printf("  peak = %f MB (highest memusage())\n", (double)usage_peak / (1 << 20));
+    printf("\n");
+
+    for (int k = 0; k < live_count; ++k)
+        free(live[k]);
+
+    free(live);
+
+    return 0;
+}
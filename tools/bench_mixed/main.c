@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2019 Frank Mertens.
+ *
+ * Distribution and use is allowed under the terms of the zlib license
+ * (see kissmalloc/LICENSE).
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+
+static int random_get(const int a, const int b)
+{
+    const unsigned m = (1u << 31) - 1;
+    static unsigned x = 7;
+    x = (16807 * x) % m;
+    return ((uint64_t)x * (b - a)) / (m - 1) + a;
+}
+
+static double time_get()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double rss_get()
+{
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) pages = 0;
+        fclose(statm);
+    }
+    return (double)pages * sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+int main(int argc, char **argv)
+{
+    const int round_count = 4;
+    const int object_count = 500000;
+    const int survivor_ratio = 64;
+
+    /// mostly small objects with a long tail up to 2 KB, as seen in typical service heaps
+    const int size_min = 8;
+    const int size_max = 2048;
+
+    void **object = malloc(object_count * sizeof(void *));
+    int *object_size = malloc(object_count * sizeof(int));
+    const int survivor_max = 2 * round_count * (object_count / survivor_ratio);
+    void **survivor = malloc(survivor_max * sizeof(void *));
+    int survivor_count = 0;
+
+    for (int i = 0; i < object_count; ++i) {
+        object_size[i] = random_get(0, 4) == 0 ? random_get(size_min, size_max) : random_get(size_min, 128);
+    }
+
+    printf(
+        "kissmalloc mixed-size malloc()/free() benchmark\n"
+        "-----------------------------------------------\n"
+        "\n"
+        "n = %d (number of objects per round)\n"
+        "r = %d (number of rounds)\n"
+        "s = 1/%d (ratio of objects surviving all rounds)\n"
+        "\n",
+        object_count,
+        round_count,
+        survivor_ratio
+    );
+
+    const double rss_start = rss_get();
+
+    double t_malloc = 0;
+    double t_free = 0;
+
+    for (int r = 0; r < round_count; ++r)
+    {
+        double t = time_get();
+
+        for (int i = 0; i < object_count; ++i)
+            object[i] = malloc(object_size[(i + r) % object_count]);
+
+        t_malloc += time_get() - t;
+
+        for (int i = 0; i < object_count; ++i) {
+            if (survivor_count < survivor_max && random_get(0, survivor_ratio) == 0) {
+                survivor[survivor_count] = object[i];
+                ++survivor_count;
+                object[i] = NULL;
+            }
+        }
+
+        t = time_get();
+
+        for (int i = 0; i < object_count; ++i)
+            free(object[i]);
+
+        t_free += time_get() - t;
+    }
+
+    const double rss_end = rss_get();
+
+    printf("malloc() speed:\n");
+    printf("  t/n = %f ns (average latency of an allocation)\n", t_malloc / object_count / round_count * 1e9);
+    printf("\n");
+    printf("free() speed:\n");
+    printf("  t/n = %f ns (average latency of a deallocation)\n", t_free / object_count / round_count * 1e9);
+    printf("\n");
+    printf("memory pinned by survivors:\n");
+    printf("  m = %d (number of surviving objects)\n", survivor_count);
+    printf("  rss = %f MB (resident set size growth)\n", rss_end - rss_start);
+    printf("\n");
+
+    for (int i = 0; i < survivor_count; ++i)
+        free(survivor[i]);
+
+    free(survivor);
+    free(object);
+    free(object_size);
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+/*
+ * Copyright (C) 2019 Frank Mertens.
+ *
+ * Distribution and use is allowed under the terms of the zlib license
+ * (see kissmalloc/LICENSE).
+ *
+ */
+
+/// Same benchmark as kissbench_mixed, but with kissmalloc compiled in using size-class pages
+
+#define KISSMALLOC_SIZE_CLASSES
+
+#include "../../src/kissmalloc.c"
+#include "../bench_mixed/main.c"
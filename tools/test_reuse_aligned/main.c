@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2019 Frank Mertens.
+ *
+ * Distribution and use is allowed under the terms of the zlib license
+ * (see kissmalloc/LICENSE).
+ *
+ */
+
+/// Regression test: an aligned block inside a size-class slot needs to be returned to the free list by the start of its
+/// slot, otherwise later allocations of the same class are handed out shifted and overrun their slot (exits with 1 on failure)
+
+#define KISSMALLOC_REUSE
+
+#include "../../src/kissmalloc.c"
+#include <stdio.h>
+
+int main()
+{
+    for (size_t alignment = 2 * KISSMALLOC_GRANULARITY; alignment <= 256; alignment *= 2) {
+        for (size_t size = 1; size <= KISSMALLOC_SIZE_CLASS_MAX; size += 13) {
+            void *block = NULL;
+            if (posix_memalign(&block, alignment, size) != 0) {
+                printf("posix_memalign(%zu, %zu) failed\n", alignment, size);
+                return 1;
+            }
+            free(block);
+            for (int class_index = 0; class_index < KISSMALLOC_SIZE_CLASS_COUNT; ++class_index) {
+                const size_t request = size_class_size(class_index);
+                void *next = malloc(request);
+                const size_t usable = malloc_usable_size(next);
+                free(next);
+                if (usable < request) {
+                    printf("alignment %zu, size %zu: malloc(%zu) returned a block of %zu usable bytes\n", alignment, size, request, usable);
+                    return 1;
+                }
+            }
+        }
+    }
+
+    printf("ok\n");
+
+    return 0;
+}